@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include "devices/ide.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A block device. */
 struct block
@@ -21,6 +22,10 @@ struct block
     unsigned long long write_cnt;       /* Number of sectors written. */
   };
 
+/* Maximum number of sectors block_read_multiple() and
+   block_write_multiple() pass to a driver in one call. */
+#define MULTIPLE_MAX 16
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -28,6 +33,8 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void transfer (struct block *, block_sector_t, void *const buffers[],
+                      size_t cnt, bool is_write);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -113,6 +120,18 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR are within
+   BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  check_sector (block, sector);
+  if (cnt > block->size - sector)
+    PANIC ("Access past end of device %s (sector=%"PRDSNu", cnt=%zu, "
+           "size=%"PRDSNu")\n", block_name (block), sector, cnt,
+           block->size);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +139,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_readv (block, sector, &buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +150,112 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  void *buffers[1] = { (void *) buffer };
+
+  block_writev (block, sector, buffers, 1);
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that support it transfer the sectors with as
+   few commands as possible. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  void *buffers[MULTIPLE_MAX];
+  uint8_t *p = buffer;
+  size_t i, n;
+
+  for (; cnt > 0; cnt -= n, sector += n, p += n * BLOCK_SECTOR_SIZE)
+    {
+      n = cnt < MULTIPLE_MAX ? cnt : MULTIPLE_MAX;
+      for (i = 0; i < n; i++)
+        buffers[i] = p + i * BLOCK_SECTOR_SIZE;
+      block_readv (block, sector, buffers, n);
+    }
+}
+
+/* Writes the CNT sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  void *buffers[MULTIPLE_MAX];
+  const uint8_t *p = buffer;
+  size_t i, n;
+
+  for (; cnt > 0; cnt -= n, sector += n, p += n * BLOCK_SECTOR_SIZE)
+    {
+      n = cnt < MULTIPLE_MAX ? cnt : MULTIPLE_MAX;
+      for (i = 0; i < n; i++)
+        buffers[i] = (void *) (p + i * BLOCK_SECTOR_SIZE);
+      block_writev (block, sector, buffers, n);
+    }
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK, sector
+   SECTOR + I into BUFFERS[I], each of which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+block_readv (struct block *block, block_sector_t sector,
+             void *const buffers[], size_t cnt)
+{
+  transfer (block, sector, buffers, cnt, false);
+}
+
+/* Writes the CNT sectors starting at SECTOR to BLOCK, sector
+   SECTOR + I from BUFFERS[I], each of which must contain
+   BLOCK_SECTOR_SIZE bytes.  The buffers are not modified.
+   Returns after the block device has acknowledged receiving the
+   data. */
+void
+block_writev (struct block *block, block_sector_t sector,
+              void *const buffers[], size_t cnt)
+{
+  transfer (block, sector, buffers, cnt, true);
+}
+
+/* Starts the transfer described by REQ on BLOCK and returns,
+   possibly before the transfer is done.  REQ->complete is called
+   when it is.  REQ and its buffers must not be modified or freed
+   until then. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  block_forward (block, req->sector, req);
+}
+
+/* A completion function for requests whose AUX is a semaphore to
+   up when they complete. */
+void
+block_request_wake (struct block_request *req)
+{
+  sema_up (req->aux);
+}
+
+/* Transfers CNT sectors starting at SECTOR between BLOCK and
+   BUFFERS, writing to BLOCK if IS_WRITE is true and reading from
+   it otherwise, and waits for the transfer to complete. */
+static void
+transfer (struct block *block, block_sector_t sector, void *const buffers[],
+          size_t cnt, bool is_write)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  req.is_write = is_write;
+  req.sector = sector;
+  req.buffers = buffers;
+  req.cnt = cnt;
+  req.complete = block_request_wake;
+  req.aux = &done;
+  block_submit (block, &req);
+  sema_down (&done);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -211,6 +330,47 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Submits REQ to BLOCK, as block_submit(), but transfers the
+   sectors starting at SECTOR instead of REQ->sector.  For use by
+   drivers for block devices, such as partitions, that are parts
+   of other block devices. */
+void
+block_forward (struct block *block, block_sector_t sector,
+               struct block_request *req)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  ASSERT (req->cnt > 0);
+
+  check_sectors (block, sector, req->cnt);
+  if (req->is_write)
+    {
+      ASSERT (block->type != BLOCK_FOREIGN);
+      block->write_cnt += req->cnt;
+    }
+  else
+    block->read_cnt += req->cnt;
+
+  if (ops->submit != NULL)
+    ops->submit (block->aux, sector, req);
+  else
+    {
+      /* The driver only supports synchronous transfers. */
+      if (req->is_write && ops->write_multiple != NULL)
+        ops->write_multiple (block->aux, sector, req->buffers, req->cnt);
+      else if (req->is_write)
+        for (i = 0; i < req->cnt; i++)
+          ops->write (block->aux, sector + i, req->buffers[i]);
+      else if (ops->read_multiple != NULL)
+        ops->read_multiple (block->aux, sector, req->buffers, req->cnt);
+      else
+        for (i = 0; i < req->cnt; i++)
+          ops->read (block->aux, sector + i, req->buffers[i]);
+      req->complete (req);
+    }
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
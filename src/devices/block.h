@@ -1,8 +1,10 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,9 +55,43 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *, size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
+void block_readv (struct block *, block_sector_t, void *const buffers[],
+                  size_t cnt);
+void block_writev (struct block *, block_sector_t, void *const buffers[],
+                   size_t cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous block device operations. */
+
+/* A request to transfer CNT consecutive sectors, starting at
+   SECTOR, to or from BUFFERS, one sector per buffer.  When the
+   transfer is complete, COMPLETE is called with the request.
+   It may be called from an interrupt handler, so it must not
+   sleep. */
+struct block_request
+  {
+    bool is_write;                      /* Write if true, read if false. */
+    block_sector_t sector;              /* First sector. */
+    void *const *buffers;               /* BLOCK_SECTOR_SIZE buffers. */
+    size_t cnt;                         /* Number of sectors. */
+    void (*complete) (struct block_request *);  /* Completion callback. */
+    void *aux;                          /* For use by COMPLETE. */
+
+    /* Owned by the driver while the request is pending. */
+    struct list_elem elem;              /* Element in a request queue. */
+    struct list_elem fifo_elem;         /* Element in a FIFO queue. */
+    block_sector_t dev_sector;          /* SECTOR on the driver's device. */
+    void *dev;                          /* Driver's device. */
+    int64_t deadline;                   /* Tick to dispatch by. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+void block_request_wake (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -65,10 +101,28 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Transfer CNT consecutive sectors to or from BUFFERS, one
+       sector per buffer.  Optional: if null, the block layer
+       calls read or write once per sector instead. */
+    void (*read_multiple) (void *aux, block_sector_t,
+                           void *const buffers[], size_t cnt);
+    void (*write_multiple) (void *aux, block_sector_t,
+                            void *const buffers[], size_t cnt);
+
+    /* Starts the transfer described by a request, using the
+       given sector in place of the request's own, and returns
+       without waiting for it to complete.  Optional: if null,
+       the block layer performs the transfer with the operations
+       above and then completes the request.  If present, the
+       operations above are not used. */
+    void (*submit) (void *aux, block_sector_t, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_forward (struct block *, block_sector_t,
+                    struct block_request *);
 
 #endif /* devices/block.h */
@@ -2,16 +2,25 @@
 #include <ctype.h>
 #include <debug.h>
 #include <stdbool.h>
+#include <round.h>
 #include <stdio.h>
 #include "devices/block.h"
+#include "devices/iosched.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the
+   controller is a PCI bus master IDE controller, such as the
+   PIIX emulated by QEMU, sectors are transferred by DMA as
+   described in [SFF-8038i].  Otherwise they're transferred by
+   PIO. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +39,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the channel's
+   bus master base. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Bus Master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus Master Status Register bits. */
+#define BM_STA_SIMPLEX 0x80     /* Only one channel may use DMA. */
+#define BM_STA_INTR 0x04        /* Disk interrupted (write 1 to clear). */
+#define BM_STA_ERROR 0x02       /* Transfer failed (write 1 to clear). */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +74,34 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA with retries. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA with retries. */
+
+/* PCI class and subclass of IDE controllers. */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+
+/* IDE controller programming interface bits. */
+#define PROG_IF_BUS_MASTER 0x80 /* Supports bus master DMA. */
+#define PROG_IF_NATIVE 0x05     /* Either channel in native PCI mode. */
+
+/* A physical region descriptor, which describes one physically
+   contiguous piece of memory for a DMA transfer.  A piece may
+   not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT for the last descriptor. */
+  };
+
+#define PRD_EOT 0x8000                  /* End of table. */
+#define PRD_BOUNDARY 0x10000            /* Pieces can't cross this. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
+/* Maximum number of sectors transferred by one command.  A
+   sector count of 0 in the Sector Count register means 256. */
+#define MAX_SECTORS_PER_CMD 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +110,7 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    struct iosched_queue queue; /* Pending block_requests. */
   };
 
 /* An ATA channel (aka controller).
@@ -67,11 +121,24 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if no DMA. */
+    struct prd *prdt;           /* Physical region descriptor table. */
+
+    /* Batch of requests for consecutive sectors in progress. */
+    struct list active;         /* Requests in the batch. */
+    struct ata_disk *active_disk;       /* Disk, or null if idle. */
+    bool active_is_write;       /* Direction of the batch. */
+    block_sector_t active_sector;       /* First sector of the batch. */
+    size_t active_total;        /* Sectors in the batch. */
+    size_t active_done;         /* Sectors already transferred. */
+    size_t active_cnt;          /* Sectors in the current command. */
+    size_t active_pio_cnt;      /* Sectors of the command moved by PIO. */
+    int next_dev_no;            /* Disk whose queue to check first. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,17 +148,24 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
-static void issue_pio_command (struct channel *, uint8_t command);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
+static void issue_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static void start_request (struct channel *);
+static void start_command (struct channel *);
+static void continue_request (struct channel *);
+static void *batch_buffer (struct channel *, size_t sector);
+static void build_prdt (struct channel *, size_t start, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
+static bool poll_while_busy (const struct ata_disk *);
 static void select_device (const struct ata_disk *);
 static void select_device_wait (const struct ata_disk *);
 
@@ -101,6 +175,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -123,9 +198,27 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      list_init (&c->active);
+      c->active_disk = NULL;
+      c->next_dev_no = 0;
+
+      /* Set up DMA, if the controller supports it. */
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+      c->prdt = NULL;
+      if (c->bm_base != 0 && chan_no > 0
+          && (inb (reg_bm_status (c)) & BM_STA_SIMPLEX))
+        c->bm_base = 0;
+      if (c->bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt == NULL)
+            c->bm_base = 0;
+        }
+      if (c->bm_base != 0)
+        printf ("%s: bus master DMA at port 0x%"PRIx16"\n",
+                c->name, c->bm_base);
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +229,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          iosched_init (&d->queue);
         }
 
       /* Register interrupt handler. */
@@ -155,8 +249,52 @@ ide_init (void)
     }
 }
 
+/* Prints the I/O scheduling statistics for each disk. */
+void
+ide_print_stats (void)
+{
+  size_t chan_no;
+  int dev_no;
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    for (dev_no = 0; dev_no < 2; dev_no++)
+      {
+        struct ata_disk *d = &channels[chan_no].devices[dev_no];
+        if (d->is_ata)
+          iosched_print_stats (&d->queue, d->name);
+      }
+}
+
 /* Disk detection and identification. */
 
+/* Looks for a PCI IDE controller that supports bus master DMA
+   on the legacy ports.  If one is found, enables it as a bus
+   master and returns its bus master base port.  Otherwise
+   returns 0, and all transfers use PIO. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_address addr;
+  uint32_t prog_if, bar4;
+
+  if (!pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &addr))
+    return 0;
+  prog_if = (pci_read_config (&addr, PCI_REG_CLASS) >> 8) & 0xff;
+  if (!(prog_if & PROG_IF_BUS_MASTER) || (prog_if & PROG_IF_NATIVE))
+    return 0;
+
+  /* BAR4 holds the bus master base port.  It must be in I/O
+     space. */
+  bar4 = pci_read_config (&addr, PCI_REG_BAR0 + 4 * 4);
+  if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+    return 0;
+
+  pci_write_config (&addr, PCI_REG_COMMAND,
+                    (pci_read_config (&addr, PCI_REG_COMMAND)
+                     | PCI_CMD_IO | PCI_CMD_MASTER));
+  return bar4 & 0xfffc;
+}
+
 static char *descramble_ata_string (char *, int size);
 
 /* Resets an ATA channel and waits for any devices present on it
@@ -272,7 +410,7 @@ identify_ata_device (struct ata_disk *d)
      indicating the device's response is ready, and read the data
      into our buffer. */
   select_device_wait (d);
-  issue_pio_command (c, CMD_IDENTIFY_DEVICE);
+  issue_command (c, CMD_IDENTIFY_DEVICE);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
     {
@@ -337,63 +475,264 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Request queue.
+
+   Each disk has a queue of pending requests, ordered by the I/O
+   scheduler.  Only one command can be in progress on a channel
+   at a time, so when a channel is idle it takes the next batch
+   of requests for consecutive sectors from one of its disks'
+   queues, alternating between the disks, and transfers the
+   batch with as few commands as possible.  Each interrupt moves
+   the batch in progress along, so a thread that submits a
+   request doesn't have to wait for it.  The queues and the
+   channel's registers are protected by disabling interrupts. */
+
+/* Queues REQ, whose sectors start at SEC_NO on disk D, and
+   starts it if the channel is idle. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_submit (void *d_, block_sector_t sec_no, struct block_request *req)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  enum intr_level old_level;
+
+  req->dev_sector = sec_no;
+  req->dev = d;
+  old_level = intr_disable ();
+  iosched_add (&d->queue, req);
+  if (c->active_disk == NULL)
+    start_request (c);
+  intr_set_level (old_level);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+static struct block_operations ide_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ide_submit
+  };
+
+/* Starts the next batch of requests on channel C, if any are
+   pending.  Interrupts must be off. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+start_request (struct channel *c)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  struct block_request *req;
+  struct ata_disk *d;
+  int i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (c->active_disk == NULL);
+
+  for (i = 0; i < 2; i++)
+    {
+      d = &c->devices[(c->next_dev_no + i) % 2];
+      if (!iosched_empty (&d->queue))
+        break;
+    }
+  if (i == 2)
+    return;
+  c->next_dev_no = (d->dev_no + 1) % 2;
+
+  c->active_total = iosched_dispatch (&d->queue, &c->active,
+                                      MAX_SECTORS_PER_CMD);
+  req = list_entry (list_front (&c->active), struct block_request, elem);
+  c->active_disk = d;
+  c->active_is_write = req->is_write;
+  c->active_sector = req->dev_sector;
+  c->active_done = 0;
+  start_command (c);
+}
+
+/* Issues the command for the next MAX_SECTORS_PER_CMD or fewer
+   sectors of channel C's active batch, by DMA if the channel
+   supports it.  Interrupts must be off. */
+static void
+start_command (struct channel *c)
+{
+  struct ata_disk *d = c->active_disk;
+  block_sector_t sec_no = c->active_sector + c->active_done;
+  size_t cnt = c->active_total - c->active_done;
+  bool is_write = c->active_is_write;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  c->active_cnt = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+  c->active_pio_cnt = 0;
+  if (c->bm_base != 0)
+    {
+      uint8_t direction = is_write ? 0 : BM_CMD_READ;
+
+      build_prdt (c, c->active_done, c->active_cnt);
+      outl (reg_bm_prdt (c), vtop (c->prdt));
+      outb (reg_bm_command (c), direction);
+      outb (reg_bm_status (c), BM_STA_INTR | BM_STA_ERROR);
+      select_sector (d, sec_no, c->active_cnt);
+      issue_command (c, is_write ? CMD_WRITE_DMA : CMD_READ_DMA);
+
+      /* Make sure the buffers and PRD table are in memory before
+         the controller starts reading them. */
+      barrier ();
+      outb (reg_bm_command (c), direction | BM_CMD_START);
+    }
+  else
+    {
+      select_sector (d, sec_no, c->active_cnt);
+      issue_command (c, (is_write
+                         ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY));
+
+      /* The disk asks for the first sector of a write right away
+         and interrupts after it has taken each one. */
+      if (is_write)
+        {
+          if (!poll_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
+          output_sector (c, batch_buffer (c, c->active_done));
+          c->active_pio_cnt++;
+        }
+    }
+}
+
+/* Handles an interrupt for channel C's active batch.  Moves PIO
+   transfers along a sector at a time.  When the batch's last
+   command finishes, starts the next batch and completes this
+   one's requests. */
+static void
+continue_request (struct channel *c)
+{
+  struct ata_disk *d = c->active_disk;
+  bool is_write = c->active_is_write;
+  size_t sector = c->active_done + c->active_pio_cnt;
+  struct list finished;
+
+  if (c->bm_base != 0)
+    {
+      uint8_t bm_status = inb (reg_bm_status (c));
+      uint8_t status = inb (reg_status (c));
+
+      outb (reg_bm_command (c), is_write ? 0 : BM_CMD_READ);
+      outb (reg_bm_status (c), BM_STA_INTR | BM_STA_ERROR);
+      if ((bm_status & BM_STA_ERROR) || (status & (STA_ERR | STA_BSY)))
+        PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+               is_write ? "write" : "read",
+               c->active_sector + c->active_done);
+    }
+  else 
+    {
+      inb (reg_status (c));
+      if (c->active_pio_cnt < c->active_cnt)
+        {
+          /* The disk has the next sector to read ready, or is
+             ready for the next sector to write. */
+          if (!poll_while_busy (d))
+            PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+                   is_write ? "write" : "read", c->active_sector + sector);
+          if (is_write)
+            output_sector (c, batch_buffer (c, sector));
+          else
+            input_sector (c, batch_buffer (c, sector));
+          c->active_pio_cnt++;
+          if (is_write || c->active_pio_cnt < c->active_cnt)
+            return;
+        }
+    }
+
+  c->active_done += c->active_cnt;
+  if (c->active_done < c->active_total)
+    {
+      start_command (c);
+      return;
+    }
+
+  /* Start the next batch before completing this one's requests,
+     whose callbacks may submit more. */
+  list_init (&finished);
+  list_splice (list_end (&finished),
+               list_begin (&c->active), list_end (&c->active));
+  c->active_disk = NULL;
+  start_request (c);
+  while (!list_empty (&finished))
+    {
+      struct block_request *req = list_entry (list_pop_front (&finished),
+                                              struct block_request, elem);
+      req->complete (req);
+    }
+}
+
+/* Returns the buffer for the given SECTOR of channel C's active
+   batch, counting from 0. */
+static void *
+batch_buffer (struct channel *c, size_t sector)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&c->active); e != list_end (&c->active);
+       e = list_next (e))
+    {
+      struct block_request *req = list_entry (e, struct block_request, elem);
+      if (sector < req->cnt)
+        return req->buffers[sector];
+      sector -= req->cnt;
+    }
+  NOT_REACHED ();
+}
+
+/* Fills in channel C's PRD table to describe the buffers for
+   the CNT sectors of its active batch starting at START.
+   Physically contiguous buffers share a descriptor, and buffers
+   that cross a 64 kB boundary are split across two. */
+static void
+build_prdt (struct channel *c, size_t start, size_t cnt)
+{
+  struct prd *prd = NULL;
+  size_t i;
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
+
+  for (i = 0; i < cnt; i++)
+    {
+      uintptr_t addr = vtop (batch_buffer (c, start + i));
+      uintptr_t end = addr + BLOCK_SECTOR_SIZE;
+
+      while (addr < end)
+        {
+          uintptr_t boundary = ROUND_DOWN (addr, PRD_BOUNDARY) + PRD_BOUNDARY;
+          size_t size = (end < boundary ? end : boundary) - addr;
+
+          /* A descriptor that ends at ADDR can grow unless ADDR is
+             on a boundary. */
+          if (prd != NULL && prd->addr + prd->size == addr
+              && addr % PRD_BOUNDARY != 0)
+            prd->size += size;
+          else
+            {
+              prd = prd == NULL ? c->prdt : prd + 1;
+              ASSERT (prd < c->prdt + PRD_CNT);
+              prd->addr = addr;
+              prd->size = size;
+              prd->flags = 0;
+            }
+          addr += size;
+        }
+    }
+  prd->flags = PRD_EOT;
 }
 
-static struct block_operations ide_operations =
-  {
-    ide_read,
-    ide_write
-  };
-
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, the number of sectors to transfer, to
+   the disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_SECTORS_PER_CMD);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -404,12 +743,8 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
-issue_pio_command (struct channel *c, uint8_t command) 
+issue_command (struct channel *c, uint8_t command) 
 {
-  /* Interrupts must be enabled or our semaphore will never be
-     up'd by the completion handler. */
-  ASSERT (intr_get_level () == INTR_ON);
-
   c->expecting_interrupt = true;
   outb (reg_command (c), command);
 }
@@ -432,8 +767,10 @@ output_sector (struct channel *c, const void *sector)
 
 /* Low-level ATA primitives. */
 
-/* Wait up to 10 seconds for the controller to become idle, that
-   is, for the BSY and DRQ bits to clear in the status register.
+/* Wait up to 10 milliseconds for the controller to become idle,
+   that is, for the BSY and DRQ bits to clear in the status
+   register.  Busy-waits, so it may be called with interrupts
+   off.
 
    As a side effect, reading the status register clears any
    pending interrupt. */
@@ -446,7 +783,7 @@ wait_until_idle (const struct ata_disk *d)
     {
       if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
         return;
-      timer_usleep (10);
+      timer_udelay (10);
     }
 
   printf ("%s: idle timeout\n", d->name);
@@ -479,6 +816,26 @@ wait_while_busy (const struct ata_disk *d)
   return false;
 }
 
+/* Busy-waits up to 100 milliseconds for disk D to clear BSY, and
+   then returns the status of the DRQ bit.  Unlike
+   wait_while_busy(), never sleeps, so it may be called from the
+   interrupt handler or with interrupts off.  Only suitable once
+   the disk is known to be responding. */
+static bool
+poll_while_busy (const struct ata_disk *d) 
+{
+  struct channel *c = d->channel;
+  int i;
+  
+  for (i = 0; i < 10000; i++)
+    {
+      if (!(inb (reg_alt_status (c)) & STA_BSY)) 
+        return (inb (reg_alt_status (c)) & STA_DRQ) != 0;
+      timer_udelay (10);
+    }
+  return false;
+}
+
 /* Program D's channel so that D is now the selected disk. */
 static void
 select_device (const struct ata_disk *d)
@@ -489,7 +846,7 @@ select_device (const struct ata_disk *d)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
   inb (reg_alt_status (c));
-  timer_nsleep (400);
+  timer_ndelay (400);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -511,7 +868,9 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt) 
+        if (c->active_disk != NULL)
+          continue_request (c);
+        else if (c->expecting_interrupt) 
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
@@ -0,0 +1,239 @@
+#include "devices/iosched.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+
+/* I/O scheduling.
+
+   A driver keeps one iosched_queue per disk.  Requests are added
+   to the queue as they are submitted, and when the disk is idle
+   the driver dispatches the next request, along with any other
+   pending requests for the sectors that immediately follow it,
+   as one command.  Which request is next depends on the policy:
+
+   - noop: first come, first served.
+
+   - cscan: circular scan.  The request for the lowest sector
+     at or after the last one dispatched is next, wrapping
+     around to the lowest sector overall, so the disk head sweeps
+     in one direction.
+
+   - deadline: as cscan, except that a request that has waited
+     longer than its deadline is next, so a stream of requests
+     near the head can't starve one far away.  Reads, which
+     usually have a thread waiting on them, have a shorter
+     deadline than writes, and an expired read goes before an
+     expired write.
+
+   Queues are accessed by drivers with interrupts off. */
+
+/* Deadlines, in milliseconds. */
+#define READ_EXPIRE_MS 50
+#define WRITE_EXPIRE_MS 500
+
+/* Scheduling policies. */
+enum iosched_policy
+  {
+    IOSCHED_NOOP,
+    IOSCHED_CSCAN,
+    IOSCHED_DEADLINE
+  };
+
+static const char *policy_names[] = { "noop", "cscan", "deadline" };
+
+/* Policy used by all queues. */
+static enum iosched_policy policy = IOSCHED_DEADLINE;
+
+static struct block_request *next_request (struct iosched_queue *);
+static struct block_request *expired_request (struct list *fifo);
+static struct block_request *find_request (struct iosched_queue *,
+                                           block_sector_t, bool is_write);
+static void remove_request (struct block_request *);
+static bool request_less (const struct list_elem *, const struct list_elem *,
+                          void *aux);
+
+/* Sets the scheduling policy to the one called NAME.  Returns
+   true if successful, false if there's no such policy.  Must be
+   called before any requests are added. */
+bool
+iosched_set_policy (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof policy_names / sizeof *policy_names; i++)
+    if (!strcmp (name, policy_names[i]))
+      {
+        policy = i;
+        return true;
+      }
+  return false;
+}
+
+/* Returns the name of the scheduling policy. */
+const char *
+iosched_policy_name (void)
+{
+  return policy_names[policy];
+}
+
+/* Initializes Q as an empty queue. */
+void
+iosched_init (struct iosched_queue *q)
+{
+  list_init (&q->requests);
+  list_init (&q->read_fifo);
+  list_init (&q->write_fifo);
+  q->head = 0;
+  q->dispatches = 0;
+  q->merges = 0;
+  q->seek_distance = 0;
+}
+
+/* Returns true if Q has no pending requests. */
+bool
+iosched_empty (struct iosched_queue *q)
+{
+  return list_empty (&q->requests);
+}
+
+/* Adds REQ, whose first sector on the disk is REQ->dev_sector,
+   to Q. */
+void
+iosched_add (struct iosched_queue *q, struct block_request *req)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  req->deadline = timer_ticks () + (req->is_write ? WRITE_EXPIRE_MS
+                                    : READ_EXPIRE_MS) * TIMER_FREQ / 1000;
+  list_push_back (req->is_write ? &q->write_fifo : &q->read_fifo,
+                  &req->fifo_elem);
+  if (policy == IOSCHED_NOOP)
+    list_push_back (&q->requests, &req->elem);
+  else
+    list_insert_ordered (&q->requests, &req->elem, request_less, NULL);
+}
+
+/* Removes the next request from Q and appends it to BATCH,
+   followed by any other pending requests in the same direction
+   for the sectors that follow it, as long as the batch covers
+   no more than MAX_CNT sectors.  Q must not be empty.  Returns
+   the number of sectors in the batch, which may be more than
+   MAX_CNT only if the first request is. */
+size_t
+iosched_dispatch (struct iosched_queue *q, struct list *batch,
+                  size_t max_cnt)
+{
+  struct block_request *req = next_request (q);
+  block_sector_t start = req->dev_sector;
+  size_t cnt = req->cnt;
+  bool is_write = req->is_write;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  remove_request (req);
+  list_push_back (batch, &req->elem);
+  while ((req = find_request (q, start + cnt, is_write)) != NULL
+         && cnt + req->cnt <= max_cnt)
+    {
+      remove_request (req);
+      list_push_back (batch, &req->elem);
+      cnt += req->cnt;
+      q->merges++;
+    }
+
+  q->dispatches++;
+  q->seek_distance += start > q->head ? start - q->head : q->head - start;
+  q->head = start + cnt;
+  return cnt;
+}
+
+/* Prints Q's statistics, labeled with NAME. */
+void
+iosched_print_stats (const struct iosched_queue *q, const char *name)
+{
+  printf ("%s (%s): %llu commands, %llu merged requests, "
+          "seek distance %llu sectors\n", name, policy_names[policy],
+          q->dispatches, q->merges, q->seek_distance);
+}
+
+/* Returns the request in Q that the policy says is next. */
+static struct block_request *
+next_request (struct iosched_queue *q)
+{
+  struct block_request *req;
+  struct list_elem *e;
+
+  ASSERT (!list_empty (&q->requests));
+
+  if (policy == IOSCHED_DEADLINE)
+    {
+      req = expired_request (&q->read_fifo);
+      if (req == NULL)
+        req = expired_request (&q->write_fifo);
+      if (req != NULL)
+        return req;
+    }
+  if (policy != IOSCHED_NOOP)
+    for (e = list_begin (&q->requests); e != list_end (&q->requests);
+         e = list_next (e))
+      {
+        req = list_entry (e, struct block_request, elem);
+        if (req->dev_sector >= q->head)
+          return req;
+      }
+  return list_entry (list_front (&q->requests), struct block_request, elem);
+}
+
+/* Returns the oldest request in FIFO if its deadline has passed,
+   or a null pointer otherwise. */
+static struct block_request *
+expired_request (struct list *fifo)
+{
+  struct block_request *req;
+
+  if (list_empty (fifo))
+    return NULL;
+  req = list_entry (list_front (fifo), struct block_request, fifo_elem);
+  return timer_ticks () >= req->deadline ? req : NULL;
+}
+
+/* Returns a pending request in Q that starts at SECTOR and
+   transfers in the same direction as IS_WRITE, or a null pointer
+   if there is none. */
+static struct block_request *
+find_request (struct iosched_queue *q, block_sector_t sector, bool is_write)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&q->requests); e != list_end (&q->requests);
+       e = list_next (e))
+    {
+      struct block_request *req = list_entry (e, struct block_request, elem);
+      if (req->dev_sector == sector && req->is_write == is_write)
+        return req;
+      if (policy != IOSCHED_NOOP && req->dev_sector > sector)
+        break;
+    }
+  return NULL;
+}
+
+/* Removes REQ from its queue. */
+static void
+remove_request (struct block_request *req)
+{
+  list_remove (&req->elem);
+  list_remove (&req->fifo_elem);
+}
+
+/* Orders requests by first sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->dev_sector < b->dev_sector;
+}
@@ -0,0 +1,35 @@
+#ifndef DEVICES_IOSCHED_H
+#define DEVICES_IOSCHED_H
+
+#include <list.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* A queue of pending block requests for one disk, ordered by
+   the I/O scheduling policy chosen at boot. */
+struct iosched_queue
+  {
+    struct list requests;       /* Pending requests, in policy order. */
+    struct list read_fifo;      /* Pending reads, oldest first. */
+    struct list write_fifo;     /* Pending writes, oldest first. */
+    block_sector_t head;        /* Sector after the last one dispatched. */
+
+    /* Statistics. */
+    unsigned long long dispatches;      /* Commands dispatched. */
+    unsigned long long merges;          /* Requests merged into others. */
+    unsigned long long seek_distance;   /* Total sectors sought. */
+  };
+
+bool iosched_set_policy (const char *name);
+const char *iosched_policy_name (void);
+
+void iosched_init (struct iosched_queue *);
+bool iosched_empty (struct iosched_queue *);
+void iosched_add (struct iosched_queue *, struct block_request *);
+size_t iosched_dispatch (struct iosched_queue *, struct list *batch,
+                         size_t max_cnt);
+void iosched_print_stats (const struct iosched_queue *, const char *name);
+
+#endif /* devices/iosched.h */
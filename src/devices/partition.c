@@ -298,27 +298,20 @@ partition_type_name (uint8_t type)
   return type_names[type] != NULL ? type_names[type] : "Unknown";
 }
 
-/* Reads sector SECTOR from partition P into BUFFER, which must
-   have room for BLOCK_SECTOR_SIZE bytes. */
+/* Starts the transfer described by REQ on partition P, with
+   its sectors starting at SECTOR within the partition. */
 static void
-partition_read (void *p_, block_sector_t sector, void *buffer)
+partition_submit (void *p_, block_sector_t sector, struct block_request *req)
 {
   struct partition *p = p_;
-  block_read (p->block, p->start + sector, buffer);
-}
-
-/* Write sector SECTOR to partition P from BUFFER, which must
-   contain BLOCK_SECTOR_SIZE bytes.  Returns after the block has
-   acknowledged receiving the data. */
-static void
-partition_write (void *p_, block_sector_t sector, const void *buffer)
-{
-  struct partition *p = p_;
-  block_write (p->block, p->start + sector, buffer);
+  block_forward (p->block, p->start + sector, req);
 }
 
 static struct block_operations partition_operations =
   {
-    partition_read,
-    partition_write
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    partition_submit
   };
@@ -0,0 +1,89 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* This code accesses PCI configuration space using configuration
+   mechanism #1, which every PC chipset Pintos runs on (including
+   the ones emulated by QEMU and Bochs) supports.  See [PCI] for
+   details. */
+
+/* I/O port addresses. */
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Selects a config register. */
+#define PCI_CONFIG_DATA    0xcfc        /* Reads or writes it. */
+
+/* Bit that must be set in PCI_CONFIG_ADDRESS for the access to
+   reach configuration space. */
+#define PCI_CONFIG_ENABLE  0x80000000
+
+/* Header type bit that indicates a multifunction device. */
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+/* Selects register REG of the function at ADDR. */
+static void
+select_config (const struct pci_address *addr, uint8_t reg)
+{
+  ASSERT (addr->dev < 32 && addr->func < 8);
+  ASSERT (reg % 4 == 0);
+
+  outl (PCI_CONFIG_ADDRESS, (PCI_CONFIG_ENABLE | (addr->bus << 16)
+                             | (addr->dev << 11) | (addr->func << 8) | reg));
+}
+
+/* Returns the 32-bit configuration register REG of the function
+   at ADDR.  REG must be a multiple of 4. */
+uint32_t
+pci_read_config (const struct pci_address *addr, uint8_t reg)
+{
+  select_config (addr, reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit configuration register REG of the
+   function at ADDR.  REG must be a multiple of 4. */
+void
+pci_write_config (const struct pci_address *addr, uint8_t reg,
+                  uint32_t value)
+{
+  select_config (addr, reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Searches every PCI bus for the first function with the given
+   CLASS and SUBCLASS.  If one is found, stores its location in
+   *ADDR and returns true.  Otherwise returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_address *addr)
+{
+  int bus, dev, func, func_cnt;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      {
+        func_cnt = 1;
+        for (func = 0; func < func_cnt; func++)
+          {
+            uint32_t class_reg;
+
+            addr->bus = bus;
+            addr->dev = dev;
+            addr->func = func;
+            if ((pci_read_config (addr, PCI_REG_ID) & 0xffff) == 0xffff)
+              {
+                /* No device, unless a multifunction device leaves a
+                   gap before its later functions. */
+                if (func == 0)
+                  break;
+                continue;
+              }
+            if (func == 0
+                && (pci_read_config (addr, PCI_REG_HEADER) >> 16)
+                    & PCI_HEADER_MULTIFUNCTION)
+              func_cnt = 8;
+            class_reg = pci_read_config (addr, PCI_REG_CLASS);
+            if ((class_reg >> 24) == class
+                && ((class_reg >> 16) & 0xff) == subclass)
+              return true;
+          }
+      }
+  return false;
+}
@@ -11,8 +11,13 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "devices/ide.h"
 #include "filesys/filesys.h"
 #endif
+#ifdef VM
+#include "vm/frametable.h"
+#include "vm/zswap.h"
+#endif
 
 /* Keyboard control register port. */
 #define CONTROL_REG 0x64
@@ -132,10 +137,15 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  ide_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
 #endif
+#ifdef VM
+  frametable_print_stats ();
+  zswap_print_stats ();
+#endif
 }
@@ -0,0 +1,115 @@
+/* fsbench.c
+
+   File layout benchmark.  Grows two files at the same time in
+   small appends, so that their sectors are allocated in
+   interleaved order, then reads each back sequentially and
+   finally at random offsets.  Run it on a file system formatted
+   with each inode layout (the kernel's -f -fs-layout option) and
+   compare the lookups and map sectors read, the disk sectors
+   transferred, and the timer ticks printed when the kernel shuts
+   down. */
+
+#include <random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+#define FILE_CNT 2                      /* Number of files. */
+#define APPEND_SIZE 4096                /* Bytes per append. */
+#define APPEND_CNT 64                   /* Appends per file. */
+#define FILE_SIZE (APPEND_SIZE * APPEND_CNT)
+#define RANDOM_CNT 256                  /* Random reads per file. */
+#define RANDOM_SIZE 512                 /* Bytes per random read. */
+
+static char buf[APPEND_SIZE];
+
+/* Fills BUF with the contents of FILE at offset OFS. */
+static void
+fill (int file, int ofs)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = file * 131 + (ofs + i) / 7;
+}
+
+/* Returns true if the SIZE bytes in BUF hold the contents of
+   FILE at offset OFS. */
+static bool
+check (int file, int ofs, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (buf[i] != (char) (file * 131 + (ofs + i) / 7))
+      return false;
+  return true;
+}
+
+int
+main (void) 
+{
+  char names[FILE_CNT][16];
+  int fds[FILE_CNT];
+  int i, j;
+
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (names[i], sizeof names[i], "fsbench.%d", i);
+      if (!create (names[i], 0) || (fds[i] = open (names[i])) < 0)
+        {
+          printf ("%s: create failed\n", names[i]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  /* Grow the files in turn. */
+  for (j = 0; j < APPEND_CNT; j++)
+    for (i = 0; i < FILE_CNT; i++)
+      {
+        fill (i, j * APPEND_SIZE);
+        if (write (fds[i], buf, APPEND_SIZE) != APPEND_SIZE)
+          {
+            printf ("%s: write failed\n", names[i]);
+            return EXIT_FAILURE;
+          }
+      }
+
+  /* Read each file back in order. */
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      seek (fds[i], 0);
+      for (j = 0; j < APPEND_CNT; j++)
+        if (read (fds[i], buf, APPEND_SIZE) != APPEND_SIZE
+            || !check (i, j * APPEND_SIZE, APPEND_SIZE))
+          {
+            printf ("%s: sequential read back wrong\n", names[i]);
+            return EXIT_FAILURE;
+          }
+    }
+
+  /* Read at random offsets. */
+  random_init (0);
+  for (i = 0; i < FILE_CNT; i++)
+    for (j = 0; j < RANDOM_CNT; j++)
+      {
+        int ofs = random_ulong () % (FILE_SIZE - RANDOM_SIZE);
+
+        seek (fds[i], ofs);
+        if (read (fds[i], buf, RANDOM_SIZE) != RANDOM_SIZE
+            || !check (i, ofs, RANDOM_SIZE))
+          {
+            printf ("%s: random read at %d wrong\n", names[i], ofs);
+            return EXIT_FAILURE;
+          }
+      }
+
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      close (fds[i]);
+      remove (names[i]);
+    }
+  printf ("fsbench: %d files, %d bytes each, ok\n", FILE_CNT, FILE_SIZE);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/* iobench.c
+
+   Disk scheduling benchmark.  Starts several child processes,
+   each of which writes a file in scrambled order and then reads
+   it back, so that the disk sees interleaved requests scattered
+   over several files.  Run it under each I/O scheduler (the
+   kernel's -iosched option) and compare the seek distance and
+   timer ticks printed when the kernel shuts down. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+#define CHILD_CNT 4                     /* Number of child processes. */
+#define CHUNK_SIZE 4096                 /* Bytes per read or write. */
+#define CHUNK_CNT 32                    /* Chunks per file. */
+
+static char buf[CHUNK_SIZE];
+
+/* Fills BUF with a pattern unique to chunk CHUNK of child ID. */
+static void
+fill (int id, int chunk)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = id * CHUNK_CNT + chunk + i;
+}
+
+/* Writes and verifies the file for child ID.  Returns true if
+   successful. */
+static bool
+run_child (int id)
+{
+  char name[16];
+  int fd, i;
+
+  snprintf (name, sizeof name, "iobench.%d", id);
+  if (!create (name, 0))
+    {
+      printf ("%s: create failed\n", name);
+      return false;
+    }
+  fd = open (name);
+  if (fd < 0)
+    {
+      printf ("%s: open failed\n", name);
+      return false;
+    }
+
+  /* Write the chunks in a scrambled order: 7 is relatively
+     prime to CHUNK_CNT, so every chunk is written once. */
+  for (i = 0; i < CHUNK_CNT; i++)
+    {
+      int chunk = i * 7 % CHUNK_CNT;
+
+      fill (id, chunk);
+      seek (fd, chunk * CHUNK_SIZE);
+      if (write (fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+        {
+          printf ("%s: write failed\n", name);
+          return false;
+        }
+    }
+
+  /* Read them back in order. */
+  seek (fd, 0);
+  for (i = 0; i < CHUNK_CNT; i++)
+    {
+      static char expected[CHUNK_SIZE];
+
+      fill (id, i);
+      memcpy (expected, buf, sizeof buf);
+      if (read (fd, buf, CHUNK_SIZE) != CHUNK_SIZE
+          || memcmp (buf, expected, sizeof buf))
+        {
+          printf ("%s: chunk %d read back wrong\n", name, i);
+          return false;
+        }
+    }
+  close (fd);
+  return true;
+}
+
+int
+main (int argc, char *argv[]) 
+{
+  pid_t children[CHILD_CNT];
+  bool success = true;
+  int i;
+
+  if (argc == 2)
+    return run_child (atoi (argv[1])) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  for (i = 0; i < CHILD_CNT; i++)
+    {
+      char cmd[32];
+
+      snprintf (cmd, sizeof cmd, "%s %d", argv[0], i);
+      children[i] = exec (cmd);
+      if (children[i] == PID_ERROR)
+        {
+          printf ("%s: exec failed\n", cmd);
+          return EXIT_FAILURE;
+        }
+    }
+  for (i = 0; i < CHILD_CNT; i++)
+    {
+      char name[16];
+
+      if (wait (children[i]) != EXIT_SUCCESS)
+        success = false;
+      snprintf (name, sizeof name, "iobench.%d", i);
+      remove (name);
+    }
+  printf ("iobench: %d processes, %d bytes each, %s\n", CHILD_CNT,
+          CHUNK_SIZE * CHUNK_CNT, success ? "ok" : "FAILED");
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,32 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <round.h>
+#include <inttypes.h>
 #include "threads/thread.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "filesys/filesys.h"
 #include "filesys/buffers.h"
+#include "filesys/journal.h"
 #include "devices/timer.h"
 
 /* Implements a buffer cache.  Buffers are read in from the file system and 
    cached for subsequent use.  Dirty buffers are written back to the file 
    system periodically by a background thread or when they are evicted to make
-   space for a new buffer.  Asynchronous read ahead is supported. */
+   space for a new buffer.  Asynchronous read ahead is supported.
+
+   The cache is partitioned into shards by sector hash.  A sector is only
+   ever cached in one of its shard's buffers, so each shard has its own lock
+   and does its own eviction, and processes using sectors in different shards
+   don't contend with each other.  Within a shard, cached buffers are indexed
+   by sector in a hash table so that finding a buffer doesn't depend on the
+   size of the cache.  Buffers that are not in use are kept on least recently
+   used lists, one for each of the replacement policy's queues, so a buffer to
+   evict can be found without searching.  The replacement policy is chosen at
+   boot. */
 
 /* Buffer flags. */
 /* If set, the buffer is currently in use by a process. */
@@ -17,17 +34,42 @@
 /* If set, the buffer contents do not match the disk contents. */
 #define BUF_DIRTY              0x02
 /* Marks a buffer as meta data (inode) as opposed to just plain data.
-   When searching for a buffer to use, data buffers are chosen over 
-   meta data buffers.  Inodes should remain in the cache
-   for as long as possible for performance reasons. */
+   When searching for a buffer to use, the replacement policies choose data
+   buffers over meta data buffers.  Inodes should remain in the cache
+   for as long as possible for performance reasons.  Changes to meta data
+   go through the journal instead of being written back. */
 #define BUF_META               0x08
 
-#define CACHE_SIZE             64
+/* Smallest number of buffers in the cache. */
+#define CACHE_MIN_SIZE         64
+/* Unless configured otherwise, the percentage of the kernel pool's pages
+   used for buffers. */
+#define CACHE_DEFAULT_PCT      10
+/* The cache is never allowed to take more than this percentage of the kernel
+   pool's pages. */
+#define CACHE_MAX_PCT          50
+#define BUFFERS_PER_PAGE       (PGSIZE / BLOCK_SECTOR_SIZE)
+/* The number of independently locked shards. */
+#define SHARD_BITS             3
+#define SHARD_CNT              (1 << SHARD_BITS)
+/* The maximum number of consecutive sectors written back or read ahead
+   with one request. */
+#define CLUSTER_SIZE           8
+/* The maximum number of clusters the read ahead and write back threads
+   have in flight at once. */
+#define CLUSTERS_IN_FLIGHT     4
+/* The number of replacement policy queues in each shard. */
+#define QUEUE_CNT              2
 /* How often the background write back thread wakes up to write dirty
    buffers to disk. */
 #define WRITE_BACK_INTERVAL_MS 100
+/* How long a buffer stays dirty before the write back thread writes it,
+   unless more than DIRTY_HIGH_PCT percent of the cache is dirty, in which
+   case it writes them all. */
+#define DIRTY_EXPIRE_MS        500
+#define DIRTY_HIGH_PCT         25
 
-/* Read ahead sectors placed on the read ahead queue. */
+/* A read ahead sector taken off the read ahead queue. */
 struct read_ahead_sector
 {
   /* The disk sector to read. */
@@ -35,18 +77,115 @@ struct read_ahead_sector
   bool is_meta;
 };
 
-static struct buffer buffers[CACHE_SIZE];
-static struct lock cache_lock;
-static struct list cache;
-/* When signaled indicates that a buffer is available. */
-static struct condition buffer_available;
+/* A range of consecutive sectors placed on the read ahead queue. */
+struct read_ahead_range
+{
+  block_sector_t sector;
+  size_t cnt;
+  bool is_meta;
+};
+
+/* A dirty sector found by the write back thread. */
+struct dirty_sector
+{
+  block_sector_t sector;
+  int64_t dirty_ticks;
+};
+
+/* A request to read or write in use buffers holding consecutive
+   sectors. */
+struct cluster
+{
+  struct block_request request;
+  struct buffer *buffers[CLUSTER_SIZE];
+  void *data[CLUSTER_SIZE];
+  size_t cnt;
+};
+
+/* An independently locked part of the cache. */
+struct cache_shard
+{
+  /* Protects the shard and its buffers. */
+  struct lock lock;
+  /* The shard's buffers. */
+  struct buffer *buffers;
+  size_t buffer_cnt;
+  /* Cached buffers indexed by sector. */
+  struct hash index;
+  /* The buffers holding a sector in each of the replacement policy's
+     queues.  Buffers that are available for eviction are on their queue's
+     list, least recently used first.  A buffer is on one of these lists if
+     and only if it's not in use and no process is waiting on it. */
+  struct list queues[QUEUE_CNT];
+  size_t queue_size[QUEUE_CNT];
+  /* Buffers that have never held a sector. */
+  struct list free;
+  /* 2Q's ghost queue, a ring of recently evicted sectors, and its index. */
+  struct ghost *ghosts;
+  size_t ghost_cnt;
+  size_t ghost_next;
+  struct hash ghost_index;
+  /* Buffers whose previous sector is being written back.  Usually empty or 
+     very short. */
+  struct list evicting;
+  /* When signaled indicates that a buffer is available. */
+  struct condition buffer_available;
+  /* Statistics. */
+  int accesses;
+  int hits;
+  int misses;
+  /* The number of buffers examined while looking up sectors. */
+  int scans;
+  /* The number of times the lock was already held when acquiring it and
+     the total time spent waiting for it. */
+  int lock_waits;
+  int64_t lock_wait_ticks;
+};
+
+/* A buffer replacement policy.  When a sector is loaded, the policy chooses
+   which of the shard's queues its buffer belongs to, and when a buffer is 
+   needed it chooses the buffer to evict.  All of the functions are called
+   with the shard locked. */
+struct cache_policy
+{
+  const char *name;
+  /* Initializes the policy's state for SHARD. */
+  void (*init) (struct cache_shard *shard);
+  /* Returns the queue for SECTOR, which is being loaded into a buffer. */
+  int (*load) (struct cache_shard *shard, block_sector_t sector,
+               bool is_meta);
+  /* Returns the buffer to evict next or NULL if none is available. */
+  struct buffer *(*victim) (struct cache_shard *shard);
+  /* Called when BUFFER's sector is about to be evicted. */
+  void (*evict) (struct cache_shard *shard, struct buffer *buffer);
+};
+
+/* A sector remembered by 2Q after it was evicted. */
+struct ghost
+{
+  block_sector_t sector;
+  struct hash_elem hash_elem;
+};
+
+/* The number of buffers in the cache and, if cache_size_is_pct is true, 
+   the percentage of the kernel pool's pages to use for them. */
+static size_t cache_size = CACHE_DEFAULT_PCT;
+static bool cache_size_is_pct = true;
+static struct cache_shard shards[SHARD_CNT];
+static const struct cache_policy *policy;
+/* Serializes sweeps of the dirty buffers, which use dirty_sectors. */
+static struct lock write_back_lock;
+/* The dirty sectors found by a sweep, one entry per buffer. */
+static struct dirty_sector *dirty_sectors;
 /* Read ahead. */
 static struct lock read_ahead_lock;
-/* Read ahead queue. */
-static struct read_ahead_sector read_ahead_sectors[CACHE_SIZE];
-static int sectors_head;
-static int sectors_tail;
-static size_t sectors_size;
+/* Read ahead queue, a ring of ranges with one entry per buffer. */
+static struct read_ahead_range *read_ahead_ranges;
+static size_t ranges_head;
+static size_t ranges_tail;
+static size_t ranges_size;
+/* The number of sectors dropped because the read ahead queue was full. */
+static int read_ahead_drops;
 /* When signaled indicates a buffer is available for reading ahead. */
 static struct condition read_ahead_available;
 /* Stops the read ahead thread. */
@@ -54,37 +193,138 @@ static bool stop_read_ahead;
 /* Used to wait for the read ahead thread to exit. */
 static struct semaphore read_ahead_done;
 
-static int cache_accesses;
-static int cache_hits;
-
-static struct buffer *get_buffer_to_acquire (block_sector_t sector);
-static struct buffer *get_buffer_to_write_back (void);
+static struct cache_shard *get_shard (block_sector_t sector);
+static void shard_lock (struct cache_shard *shard);
+static void shard_unlock (struct cache_shard *shard);
+static struct buffer *get_buffer_to_acquire (struct cache_shard *shard,
+                                             block_sector_t sector);
+static struct buffer *acquire_buffer (block_sector_t sector, bool is_meta,
+                                      bool read);
+static void lock_buffer (struct buffer *buffer);
+static struct buffer *get_buffer_to_write_back (struct cache_shard *shard);
+static struct buffer *get_dirty_buffer (block_sector_t sector);
+static struct buffer *get_read_ahead_buffer (
+  const struct read_ahead_sector *ra_sector);
 static void load_buffer (block_sector_t sector, bool is_meta,
                          struct buffer *buffer);
+static void assign_buffer (block_sector_t sector, bool is_meta,
+                           struct buffer *buffer);
+static void submit_cluster (struct cluster *cluster, bool is_write,
+                            struct semaphore *done);
+static void finish_clusters (struct cluster clusters[], size_t cnt,
+                             struct semaphore *done);
 static void flush_all (void);
+static void write_back_dirty (bool all);
+static size_t collect_dirty (void);
+static int dirty_sector_compare (const void *a, const void *b);
+static void flush_shard (struct cache_shard *shard);
 static void read_ahead (void *aux UNUSED);
 static void write_back (void *aux UNUSED);
+static size_t compute_cache_size (void);
+static unsigned buffer_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool buffer_less (const struct hash_elem *a, const struct hash_elem *b,
+                         void *aux UNUSED);
+static void lru_init (struct cache_shard *shard);
+static int lru_load (struct cache_shard *shard, block_sector_t sector,
+                     bool is_meta);
+static struct buffer *lru_victim (struct cache_shard *shard);
+static void lru_evict (struct cache_shard *shard, struct buffer *buffer);
+static void twoq_init (struct cache_shard *shard);
+static int twoq_load (struct cache_shard *shard, block_sector_t sector,
+                      bool is_meta);
+static struct buffer *twoq_victim (struct cache_shard *shard);
+static void twoq_evict (struct cache_shard *shard, struct buffer *buffer);
+static unsigned ghost_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
+
+/* The available replacement policies.  The first is the default. */
+static const struct cache_policy policies[] =
+  {
+    {"lru", lru_init, lru_load, lru_victim, lru_evict},
+    {"2q", twoq_init, twoq_load, twoq_victim, twoq_evict},
+  };
+
+/* Sets the size of the cache to SIZE buffers or, if IS_PCT is true, to SIZE
+   percent of the kernel pool's pages.  Must be called before 
+   buffers_init. */
+void
+buffers_configure (size_t size, bool is_pct)
+{
+  cache_size = size;
+  cache_size_is_pct = is_pct;
+}
+
+/* Sets the buffer replacement policy to the one called NAME.  Returns true
+   if successful, false if there's no such policy.  Must be called before
+   buffers_init. */
+bool
+buffers_set_policy (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof policies / sizeof *policies; i++)
+    if (!strcmp (name, policies[i].name))
+      {
+        policy = &policies[i];
+        return true;
+      }
+  return false;
+}
 
 void
 buffers_init (void)
 {
-  int i;
+  struct cache_shard *shard;
+  struct buffer *buffer;
+  uint8_t *page = NULL;
+  size_t i, j;
 
-  list_init (&cache);
-  lock_init (&cache_lock);
-  cond_init (&buffer_available);
+  cache_size = compute_cache_size ();
+  if (policy == NULL)
+    policy = &policies[0];
+  read_ahead_ranges = calloc (cache_size, sizeof *read_ahead_ranges);
+  dirty_sectors = calloc (cache_size, sizeof *dirty_sectors);
+  if (read_ahead_ranges == NULL || dirty_sectors == NULL)
+    PANIC ("buffer cache allocation failed");
+  lock_init (&write_back_lock);
+  for (i = 0; i < SHARD_CNT; i++)
+    {
+      shard = &shards[i];
+      lock_init (&shard->lock);
+      shard->buffer_cnt = cache_size / SHARD_CNT;
+      shard->buffers = calloc (shard->buffer_cnt, sizeof *shard->buffers);
+      if (shard->buffers == NULL)
+        PANIC ("buffer cache allocation failed");
+      hash_init (&shard->index, buffer_hash, buffer_less, NULL);
+      for (j = 0; j < QUEUE_CNT; j++)
+        list_init (&shard->queues[j]);
+      list_init (&shard->free);
+      list_init (&shard->evicting);
+      cond_init (&shard->buffer_available);
+      for (j = 0; j < shard->buffer_cnt; j++)
+        {
+          buffer = &shard->buffers[j];
+          /* Buffer data is carved out of pages from the kernel pool. */
+          if (j % BUFFERS_PER_PAGE == 0)
+            page = palloc_get_page (PAL_ASSERT);
+          buffer->shard = shard;
+          buffer->sector = UINT_MAX;
+          buffer->evicting_sector = UINT_MAX;
+          buffer->data = page + j % BUFFERS_PER_PAGE * BLOCK_SECTOR_SIZE;
+          cond_init (&buffer->available);
+          cond_init (&buffer->evicted);
+          list_push_back (&shard->free, &buffer->elem);
+        }
+      policy->init (shard);
+    }
   lock_init (&read_ahead_lock);
   cond_init (&read_ahead_available);
   sema_init (&read_ahead_done, 0);
   stop_read_ahead = false;
-  for (i = 0; i < CACHE_SIZE; i++)
-    {
-      buffers[i].sector = UINT_MAX;
-      buffers[i].evicting_sector = UINT_MAX;
-      cond_init (&buffers[i].available);
-      cond_init (&buffers[i].evicted);
-      list_push_back (&cache, &buffers[i].elem);
-    }
+  printf ("buffer cache: %zu buffers (", cache_size);
+  print_human_readable_size ((uint64_t) cache_size * BLOCK_SECTOR_SIZE);
+  printf (") in %d shards, %s replacement\n", SHARD_CNT, policy->name);
   thread_create ("read_ahead", PRI_DEFAULT, read_ahead, NULL);
   thread_create ("write_back", PRI_DEFAULT, write_back, NULL);
 }
@@ -92,14 +332,37 @@ buffers_init (void)
 void
 buffers_done (void)
 {
-  lock_acquire (&cache_lock);
+  struct cache_shard *shard;
+  int accesses = 0, hits = 0, misses = 0, scans = 0;
+  int i;
+
+  lock_acquire (&read_ahead_lock);
   stop_read_ahead = true;
-  cond_signal (&read_ahead_available, &cache_lock);
-  lock_release (&cache_lock);
+  cond_signal (&read_ahead_available, &read_ahead_lock);
+  lock_release (&read_ahead_lock);
   sema_down (&read_ahead_done);
   flush_all ();
-  printf ("cache accesses: %d, hits: %d\n", cache_accesses,
-          cache_hits);
+  for (i = 0; i < SHARD_CNT; i++)
+    {
+      shard = &shards[i];
+      accesses += shard->accesses;
+      hits += shard->hits;
+      misses += shard->misses;
+      scans += shard->scans;
+    }
+  printf ("cache accesses: %d, hits: %d, misses: %d, buffers scanned: %d\n",
+          accesses, hits, misses, scans);
+  printf ("cache read ahead sectors dropped: %d\n", read_ahead_drops);
+  if (accesses > 0)
+    printf ("cache policy %s: hit rate %d.%d%%\n", policy->name,
+            hits * 100 / accesses, hits * 1000 / accesses % 10);
+  for (i = 0; i < SHARD_CNT; i++)
+    {
+      shard = &shards[i];
+      printf ("cache shard %d: accesses: %d, hits: %d, lock waits: %d "
+              "(%"PRId64" ticks)\n", i, shard->accesses, shard->hits,
+              shard->lock_waits, shard->lock_wait_ticks);
+    }
 }
 
 /* Acquires a buffer for reading and writing.  If the buffer is already
@@ -111,26 +374,49 @@ buffers_done (void)
 struct buffer *
 buffer_acquire (block_sector_t sector, bool is_meta)
 {
+  return acquire_buffer (sector, is_meta, true);
+}
+
+/* Acquires a buffer for a newly allocated sector.  Works like
+   buffer_acquire except that the sector isn't read in; the
+   returned buffer is zeroed instead. */
+struct buffer *
+buffer_acquire_new (block_sector_t sector, bool is_meta)
+{
+  struct buffer *buffer = acquire_buffer (sector, is_meta, false);
+
+  memset (buffer->data, 0, BLOCK_SECTOR_SIZE);
+  return buffer;
+}
+
+/* Acquires a buffer for SECTOR.  On a miss the sector is read in
+   if READ is true. */
+static struct buffer *
+acquire_buffer (block_sector_t sector, bool is_meta, bool read)
+{
+  struct cache_shard *shard = get_shard (sector);
   struct buffer *buffer;
   bool acquire = false;
 
-  lock_acquire (&cache_lock);
-  cache_accesses++;
+  shard_lock (shard);
+  shard->accesses++;
 
   while (!acquire)
     {
-      buffer = get_buffer_to_acquire (sector);
+      buffer = get_buffer_to_acquire (shard, sector);
       if (buffer == NULL)
-        cond_wait (&buffer_available, &cache_lock);
+        cond_wait (&shard->buffer_available, &shard->lock);
       else if (sector == buffer->sector)
         {
-          cache_hits++;
-          buffer->waiting++;
-          while (buffer->flags & BUF_IN_USE)
-            cond_wait (&buffer->available, &cache_lock);
-          buffer->waiting--;
-          buffer->flags |= BUF_IN_USE;
-          lock_release (&cache_lock);
+          shard->hits++;
+          lock_buffer (buffer);
+          /* The sector may have been freed and reused for the other 
+             kind of data since it was loaded. */
+          if (is_meta)
+            buffer->flags |= BUF_META;
+          else
+            buffer->flags &= ~BUF_META;
+          shard_unlock (shard);
           acquire = true;
         }
       else if (sector == buffer->evicting_sector)
@@ -138,11 +424,15 @@ buffer_acquire (block_sector_t sector, bool is_meta)
           ASSERT (buffer->flags & BUF_IN_USE);
           
           while (sector == buffer->evicting_sector)
-            cond_wait (&buffer->evicted, &cache_lock);
+            cond_wait (&buffer->evicted, &shard->lock);
         }
       else
         {
-          load_buffer (sector, is_meta, buffer);
+          shard->misses++;
+          if (read)
+            load_buffer (sector, is_meta, buffer);
+          else
+            assign_buffer (sector, is_meta, buffer);
           acquire = true;
         }
     }
@@ -150,74 +440,130 @@ buffer_acquire (block_sector_t sector, bool is_meta)
 }
 
 /* Releases a buffer and marks it as dirty if it's been written to.  The
- * buffer is available for reuse if there are no processes waiting on it. */
+ * buffer is available for reuse if there are no processes waiting on it.
+ * Meta data that's been written to is handed to the journal instead, and
+ * the buffer is left clean; it's only written in place by the cache if
+ * the file system has no journal. */
 void
 buffer_release (struct buffer *buffer, bool dirty)
 {
+  struct cache_shard *shard = buffer->shard;
+
   ASSERT (buffer->flags & BUF_IN_USE);
-  
-  lock_acquire (&cache_lock);
+
+  if (dirty && (buffer->flags & BUF_META)
+      && journal_log (buffer->sector, buffer->data))
+    {
+      shard_lock (shard);
+      buffer->flags &= ~BUF_DIRTY;
+      dirty = false;
+    }
+  else
+    shard_lock (shard);
   buffer->flags &= ~BUF_IN_USE;
-  if (dirty)
-    buffer->flags |= BUF_DIRTY;
+  if (dirty && !(buffer->flags & BUF_DIRTY))
+    {
+      buffer->flags |= BUF_DIRTY;
+      buffer->dirty_ticks = timer_ticks ();
+    }
   if (buffer->waiting > 0)
-      cond_signal (&buffer->available, &cache_lock);
+      cond_signal (&buffer->available, &shard->lock);
   else
     {
-      list_remove (&buffer->elem);
-      list_push_back (&cache, &buffer->elem);
-      cond_signal (&buffer_available, &cache_lock);      
+      list_push_back (&shard->queues[buffer->queue], &buffer->elem);
+      cond_signal (&shard->buffer_available, &shard->lock);      
     }
-  lock_release (&cache_lock);
+  shard_unlock (shard);
 }
 
-/* Adds a sector to the read ahead queue.  If the queue is full, does
-   nothing. */
+/* Adds CNT consecutive sectors starting at SECTOR to the read ahead 
+   queue.  If they follow the range most recently added they're merged
+   into it.  If the queue is full, the sectors are dropped. */
 void
-buffer_read_ahead (block_sector_t sector, bool is_meta)
+buffer_read_ahead (block_sector_t sector, size_t cnt, bool is_meta)
 {
-  struct read_ahead_sector ra_sector;
+  struct read_ahead_range *range;
   
+  if (cnt == 0)
+    return;
   lock_acquire (&read_ahead_lock);
-  if (sectors_size < CACHE_SIZE)
+  range = &read_ahead_ranges[(ranges_head + cache_size - 1) % cache_size];
+  if (ranges_size > 0 && range->sector + range->cnt == sector
+      && range->is_meta == is_meta)
+    range->cnt += cnt;
+  else if (ranges_size < cache_size)
     {
-      ra_sector.sector = sector;
-      ra_sector.is_meta = is_meta;
-      read_ahead_sectors[sectors_head++ % CACHE_SIZE] = ra_sector;
-      sectors_size++;
+      range = &read_ahead_ranges[ranges_head++ % cache_size];
+      range->sector = sector;
+      range->cnt = cnt;
+      range->is_meta = is_meta;
+      ranges_size++;
       cond_signal (&read_ahead_available, &read_ahead_lock);
     }
+  else
+    read_ahead_drops += cnt;
   lock_release (&read_ahead_lock);
 }
 
-/* Loads a sector into a buffer.  If a sector is already present it's 
-   evicted. */
+/* Loads a sector into a buffer, from the journal if it has the latest
+   contents.  If a sector is already present it's evicted.  BUFFER must be
+   available for eviction and its shard must be locked.  Returns with the
+   shard unlocked. */
 static void
 load_buffer (block_sector_t sector, bool is_meta, struct buffer *buffer)
 {
+  assign_buffer (sector, is_meta, buffer);
+  if (!journal_read (buffer->sector, buffer->data))
+    block_read (fs_device, buffer->sector, buffer->data);
+}
+
+/* Assigns a sector to a buffer without reading it in.  If a sector is 
+   already present it's evicted.  BUFFER must be available for eviction and
+   its shard must be locked.  Returns with the shard unlocked and BUFFER in
+   use. */
+static void
+assign_buffer (block_sector_t sector, bool is_meta, struct buffer *buffer)
+{
+  struct cache_shard *shard = buffer->shard;
+
   ASSERT (!(buffer->flags & BUF_IN_USE));
+  ASSERT (buffer->waiting == 0);
   
+  list_remove (&buffer->elem);
   buffer->flags |= BUF_IN_USE;
   if (is_meta)
     buffer->flags |= BUF_META;
   else
     buffer->flags &= ~BUF_META;
+  if (buffer->sector != UINT_MAX)
+    {
+      policy->evict (shard, buffer);
+      shard->queue_size[buffer->queue]--;
+      hash_delete (&shard->index, &buffer->hash_elem);
+    }
+  buffer->queue = policy->load (shard, sector, is_meta);
+  shard->queue_size[buffer->queue]++;
   if (buffer->flags & BUF_DIRTY)
     {
       buffer->evicting_sector = buffer->sector;
       buffer->sector = sector;
-      lock_release (&cache_lock);
+      hash_insert (&shard->index, &buffer->hash_elem);
+      list_push_back (&shard->evicting, &buffer->elem);
+      shard_unlock (shard);
       block_write (fs_device, buffer->evicting_sector, buffer->data);
-      lock_acquire (&cache_lock);
+      shard_lock (shard);
+      list_remove (&buffer->elem);
       buffer->evicting_sector = UINT_MAX;
       buffer->flags &= ~BUF_DIRTY;
-      cond_signal (&buffer->evicted, &cache_lock);
+      cond_broadcast (&buffer->evicted, &shard->lock);
     }
   else
-    buffer->sector = sector;
-  lock_release (&cache_lock);
+    {
+      buffer->sector = sector;
+      hash_insert (&shard->index, &buffer->hash_elem);
+    }
+  shard_unlock (shard);
   ASSERT (buffer->evicting_sector == UINT_MAX);
-  block_read (fs_device, buffer->sector, buffer->data);
 }
 
 /* Writes dirty buffers until no more are available. Depending on the number
@@ -226,25 +572,168 @@ load_buffer (block_sector_t sector, bool is_meta, struct buffer *buffer)
 static
 void flush_all (void)
 {
+  int i;
+
+  /* Write what can be written in sector order, then wait for the buffers
+     that were in use. */
+  write_back_dirty (true);
+  for (i = 0; i < SHARD_CNT; i++)
+    flush_shard (&shards[i]);
+}
+
+/* Sweeps the cache for dirty buffers that aren't in use, sorts them by 
+   sector, and writes runs of consecutive sectors with as few requests as 
+   possible.  Unless ALL is true, or too much of the cache is dirty, only 
+   runs containing a buffer that has been dirty for DIRTY_EXPIRE_MS are 
+   written. */
+static void
+write_back_dirty (bool all)
+{
+  struct cluster clusters[CLUSTERS_IN_FLIGHT];
+  struct cluster *cluster = NULL;
+  struct semaphore done;
   struct buffer *buffer;
+  int64_t expire = timer_ticks () - DIRTY_EXPIRE_MS * TIMER_FREQ / 1000;
+  size_t dirty_cnt, cnt = 0;
+  size_t start, end, i;
+  bool write;
+
+  sema_init (&done, 0);
+  lock_acquire (&write_back_lock);
+  dirty_cnt = collect_dirty ();
+  if (dirty_cnt > cache_size * DIRTY_HIGH_PCT / 100)
+    all = true;
+  for (start = 0; start < dirty_cnt; start = end)
+    {
+      /* Find the run starting at START and decide whether to write it. */
+      write = all;
+      for (end = start; end < dirty_cnt; end++)
+        {
+          if (end > start
+              && dirty_sectors[end].sector != dirty_sectors[end - 1].sector + 1)
+            break;
+          if (dirty_sectors[end].dirty_ticks <= expire)
+            write = true;
+        }
+      if (!write)
+        continue;
 
-  lock_acquire (&cache_lock);
-  buffer = get_buffer_to_write_back ();
+      for (i = start; i < end; i++)
+        {
+          /* A buffer that was cleaned or put in use since the sweep splits
+             the run. */
+          buffer = get_dirty_buffer (dirty_sectors[i].sector);
+          if (buffer == NULL)
+            {
+              if (cluster != NULL)
+                submit_cluster (cluster, true, &done);
+              cluster = NULL;
+              continue;
+            }
+          if (cluster == NULL || cluster->cnt == CLUSTER_SIZE)
+            {
+              if (cluster != NULL)
+                submit_cluster (cluster, true, &done);
+              if (cnt == CLUSTERS_IN_FLIGHT)
+                {
+                  finish_clusters (clusters, cnt, &done);
+                  cnt = 0;
+                }
+              cluster = &clusters[cnt++];
+              cluster->cnt = 0;
+            }
+          cluster->buffers[cluster->cnt++] = buffer;
+        }
+      if (cluster != NULL)
+        submit_cluster (cluster, true, &done);
+      cluster = NULL;
+    }
+  finish_clusters (clusters, cnt, &done);
+  lock_release (&write_back_lock);
+}
+
+/* Stores the sectors of the dirty buffers that aren't in use in
+   dirty_sectors, sorted by sector, and returns how many there are. */
+static size_t
+collect_dirty (void)
+{
+  struct cache_shard *shard;
+  struct buffer *buffer;
+  size_t cnt = 0;
+  size_t i, j;
+
+  for (i = 0; i < SHARD_CNT; i++)
+    {
+      shard = &shards[i];
+      shard_lock (shard);
+      for (j = 0; j < shard->buffer_cnt; j++)
+        {
+          buffer = &shard->buffers[j];
+          if ((buffer->flags & (BUF_DIRTY | BUF_IN_USE)) == BUF_DIRTY
+              && buffer->waiting == 0)
+            {
+              dirty_sectors[cnt].sector = buffer->sector;
+              dirty_sectors[cnt].dirty_ticks = buffer->dirty_ticks;
+              cnt++;
+            }
+        }
+      shard_unlock (shard);
+    }
+  qsort (dirty_sectors, cnt, sizeof *dirty_sectors, dirty_sector_compare);
+  return cnt;
+}
+
+/* Writes the dirty buffers in SHARD until no more are available.  Dirty 
+   buffers for the sectors that follow each one are written along with it,
+   even if they are in other shards, and several such clusters are written
+   at once. */
+static void
+flush_shard (struct cache_shard *shard)
+{
+  struct cluster clusters[CLUSTERS_IN_FLIGHT];
+  struct cluster *cluster;
+  struct semaphore done;
+  struct buffer *buffer;
+  size_t cnt = 0;
+
+  sema_init (&done, 0);
+  shard_lock (shard);
+  buffer = get_buffer_to_write_back (shard);
   while (buffer != NULL)
     {
-      buffer->waiting++;
-      while (buffer->flags & BUF_IN_USE)
-        cond_wait (&buffer->available, &cache_lock);
-      buffer->waiting--;
-      buffer->flags |= BUF_IN_USE;
-      lock_release (&cache_lock);
-      block_write (fs_device, buffer->sector, buffer->data);
+      if (cnt > 0 && ((buffer->flags & BUF_IN_USE) || buffer->waiting > 0))
+        {
+          /* Don't wait for a buffer while holding others. */
+          shard_unlock (shard);
+          finish_clusters (clusters, cnt, &done);
+          cnt = 0;
+          shard_lock (shard);
+          buffer = get_buffer_to_write_back (shard);
+          continue;
+        }
+      lock_buffer (buffer);
       buffer->flags &= ~BUF_DIRTY;
-      buffer_release (buffer, false);
-      lock_acquire (&cache_lock);
-      buffer = get_buffer_to_write_back ();
+      shard_unlock (shard);
+      cluster = &clusters[cnt++];
+      cluster->buffers[0] = buffer;
+      for (cluster->cnt = 1; cluster->cnt < CLUSTER_SIZE; cluster->cnt++)
+        {
+          cluster->buffers[cluster->cnt]
+            = get_dirty_buffer (buffer->sector + cluster->cnt);
+          if (cluster->buffers[cluster->cnt] == NULL)
+            break;
+        }
+      submit_cluster (cluster, true, &done);
+      if (cnt == CLUSTERS_IN_FLIGHT)
+        {
+          finish_clusters (clusters, cnt, &done);
+          cnt = 0;
+        }
+      shard_lock (shard);
+      buffer = get_buffer_to_write_back (shard);
     }
-  lock_release (&cache_lock);
+  shard_unlock (shard);
+  finish_clusters (clusters, cnt, &done);
 }
 
 /* Reads in read ahead buffes until the read ahead queue is empty or it's 
@@ -252,29 +741,70 @@ void flush_all (void)
 static void
 read_ahead (void *aux UNUSED)
 {
-  struct read_ahead_sector ra_sector;
+  struct read_ahead_sector ra_sectors[CLUSTER_SIZE * CLUSTERS_IN_FLIGHT];
+  struct cluster clusters[CLUSTERS_IN_FLIGHT];
+  struct cluster *cluster;
+  struct semaphore done;
   struct buffer *buffer;
+  size_t ra_cnt, cnt, i;
   
+  sema_init (&done, 0);
   while (true)
     {
       lock_acquire (&read_ahead_lock);
-      while (sectors_size == 0 && !stop_read_ahead)
+      while (ranges_size == 0 && !stop_read_ahead)
         cond_wait (&read_ahead_available, &read_ahead_lock);      
       if (stop_read_ahead)
         break;
-      ra_sector = read_ahead_sectors[sectors_tail++ % CACHE_SIZE];
-      sectors_size--;
+      for (ra_cnt = 0; ra_cnt < CLUSTER_SIZE * CLUSTERS_IN_FLIGHT
+             && ranges_size > 0; ra_cnt++)
+        {
+          struct read_ahead_range *range
+            = &read_ahead_ranges[ranges_tail % cache_size];
+
+          ra_sectors[ra_cnt].sector = range->sector++;
+          ra_sectors[ra_cnt].is_meta = range->is_meta;
+          if (--range->cnt == 0)
+            {
+              ranges_tail++;
+              ranges_size--;
+            }
+        }
       lock_release (&read_ahead_lock);
-      lock_acquire (&cache_lock);
-      buffer = get_buffer_to_acquire (ra_sector.sector);
-      if (buffer != NULL && ra_sector.sector != buffer->sector
-          && ra_sector.sector != buffer->evicting_sector)
+
+      /* Runs of consecutive sectors that aren't cached yet are read in 
+         with one request each, several at a time. */
+      cluster = NULL;
+      cnt = 0;
+      for (i = 0; i < ra_cnt; i++)
         {
-          load_buffer (ra_sector.sector, ra_sector.is_meta, buffer);
-          buffer_release (buffer, false);
+          buffer = get_read_ahead_buffer (&ra_sectors[i]);
+          if (buffer == NULL)
+            continue;
+          if (journal_read (buffer->sector, buffer->data))
+            {
+              buffer_release (buffer, false);
+              continue;
+            }
+          if (cluster == NULL || cluster->cnt == CLUSTER_SIZE
+              || cluster->buffers[cluster->cnt - 1]->sector + 1
+                 != buffer->sector)
+            {
+              if (cluster != NULL)
+                submit_cluster (cluster, false, &done);
+              if (cnt == CLUSTERS_IN_FLIGHT)
+                {
+                  finish_clusters (clusters, cnt, &done);
+                  cnt = 0;
+                }
+              cluster = &clusters[cnt++];
+              cluster->cnt = 0;
+            }
+          cluster->buffers[cluster->cnt++] = buffer;
         }
-      else
-        lock_release (&cache_lock);
+      if (cluster != NULL)
+        submit_cluster (cluster, false, &done);
+      finish_clusters (clusters, cnt, &done);
     }
     sema_up (&read_ahead_done);
     thread_exit ();
@@ -285,55 +815,373 @@ write_back (void *aux UNUSED)
 {
   while (true)
     {
-      flush_all ();
       timer_msleep (WRITE_BACK_INTERVAL_MS);
+      journal_commit ();
+      write_back_dirty (false);
     }
 }
 
-/* Looks for a buffer in the cache.  If a buffer is already in the cache returns
-   it immediately.  If not, the least recently used unused buffer is returned 
-   with data buffers taking precedence over meta data buffers.  If no suitable 
-   buffer can be found, returns NULL. */
+/* Returns the shard that caches SECTOR.  The shard is chosen by the
+   hash's top bits, because each shard's hash table buckets by its low
+   bits: using those here would leave most of every table's buckets
+   empty. */
+static struct cache_shard *
+get_shard (block_sector_t sector)
+{
+  return &shards[hash_int (sector) >> (32 - SHARD_BITS)];
+}
+
+/* Locks SHARD, keeping track of how often and how long processes have to wait
+   for it. */
+static void
+shard_lock (struct cache_shard *shard)
+{
+  int64_t start;
+
+  if (!lock_try_acquire (&shard->lock))
+    {
+      start = timer_ticks ();
+      lock_acquire (&shard->lock);
+      shard->lock_waits++;
+      shard->lock_wait_ticks += timer_elapsed (start);
+    }
+}
+
+static void
+shard_unlock (struct cache_shard *shard)
+{
+  lock_release (&shard->lock);
+}
+
+/* Looks for a buffer in SHARD, which must be locked.  If a buffer is already
+   in the cache returns it immediately.  If not, a buffer that has never been
+   used or else the buffer chosen by the replacement policy is returned.  If
+   no suitable buffer can be found, returns NULL. */
 static struct buffer *
-get_buffer_to_acquire (block_sector_t sector)
+get_buffer_to_acquire (struct cache_shard *shard, block_sector_t sector)
 {
+  struct buffer key;
   struct buffer *buffer;
-  struct buffer *meta_buffer = NULL;
-  struct buffer *data_buffer = NULL;
+  struct hash_elem *he;
   struct list_elem *e;
 
-  for (e = list_begin (&cache); e != list_end (&cache); e = list_next (e))
+  key.sector = sector;
+  shard->scans++;
+  he = hash_find (&shard->index, &key.hash_elem);
+  if (he != NULL)
+    return hash_entry (he, struct buffer, hash_elem);
+  for (e = list_begin (&shard->evicting); e != list_end (&shard->evicting);
+       e = list_next (e))
     {
+      shard->scans++;
       buffer = list_entry (e, struct buffer, elem);
-      if (sector == buffer->sector || sector == buffer->evicting_sector)
+      if (sector == buffer->evicting_sector)
         return buffer;
-      else if (buffer->waiting == 0 && !(buffer->flags & BUF_IN_USE))
-        {
-          if (buffer->flags & BUF_META)
-            {
-              if (meta_buffer == NULL)
-                meta_buffer = buffer;
-            }
-          else if (data_buffer == NULL)
-            data_buffer = buffer;
-        }
     }
-  return data_buffer != NULL ? data_buffer : meta_buffer;
+  if (!list_empty (&shard->free))
+    return list_entry (list_front (&shard->free), struct buffer, elem);
+  return policy->victim (shard);
+}
+
+/* Waits until BUFFER is no longer in use and marks it as in use, removing it
+   from its LRU list if necessary. */
+static void
+lock_buffer (struct buffer *buffer)
+{
+  if (!(buffer->flags & BUF_IN_USE) && buffer->waiting == 0)
+    list_remove (&buffer->elem);
+  else
+    {
+      buffer->waiting++;
+      while (buffer->flags & BUF_IN_USE)
+        cond_wait (&buffer->available, &buffer->shard->lock);
+      buffer->waiting--;
+    }
+  buffer->flags |= BUF_IN_USE;
 }
 
-/* Looks for a dirty buffer in the cache.  If no suitable buffer can be found
-   returns NULL. */
+/* Looks for a dirty buffer in SHARD, which must be locked.  If no suitable
+   buffer can be found returns NULL. */
 static struct buffer *
-get_buffer_to_write_back (void)
+get_buffer_to_write_back (struct cache_shard *shard)
 {
   struct buffer *buffer;
-  struct list_elem *e;
+  size_t i;
 
-  for (e = list_begin (&cache); e != list_end (&cache); e = list_next (e))
+  for (i = 0; i < shard->buffer_cnt; i++)
     {
-      buffer = list_entry (e, struct buffer, elem);
+      buffer = &shard->buffers[i];
       if ((buffer->flags & BUF_DIRTY) && buffer->evicting_sector == UINT_MAX)
         return buffer;
     }
   return NULL;
 }
+
+/* Returns the buffer holding SECTOR, marked as in use and clean, if it's
+   dirty and available without waiting.  Otherwise returns NULL.  The
+   caller must write the buffer. */
+static struct buffer *
+get_dirty_buffer (block_sector_t sector)
+{
+  struct cache_shard *shard = get_shard (sector);
+  struct buffer key;
+  struct buffer *buffer = NULL;
+  struct hash_elem *he;
+
+  key.sector = sector;
+  shard_lock (shard);
+  he = hash_find (&shard->index, &key.hash_elem);
+  if (he != NULL)
+    {
+      buffer = hash_entry (he, struct buffer, hash_elem);
+      if ((buffer->flags & BUF_IN_USE) || buffer->waiting > 0
+          || !(buffer->flags & BUF_DIRTY))
+        buffer = NULL;
+      else
+        {
+          lock_buffer (buffer);
+          buffer->flags &= ~BUF_DIRTY;
+        }
+    }
+  shard_unlock (shard);
+  return buffer;
+}
+
+/* Assigns the read ahead sector RA_SECTOR to a buffer, without reading it 
+   in, if it isn't already cached and a buffer is available without waiting.
+   Returns the buffer, which is in use, or NULL. */
+static struct buffer *
+get_read_ahead_buffer (const struct read_ahead_sector *ra_sector)
+{
+  struct cache_shard *shard = get_shard (ra_sector->sector);
+  struct buffer *buffer;
+
+  shard_lock (shard);
+  buffer = get_buffer_to_acquire (shard, ra_sector->sector);
+  if (buffer != NULL && ra_sector->sector != buffer->sector
+      && ra_sector->sector != buffer->evicting_sector)
+    {
+      assign_buffer (ra_sector->sector, ra_sector->is_meta, buffer);
+      return buffer;
+    }
+  shard_unlock (shard);
+  return NULL;
+}
+
+/* Starts reading or writing CLUSTER's buffers, depending on IS_WRITE.  DONE
+   is upped when the transfer completes. */
+static void
+submit_cluster (struct cluster *cluster, bool is_write, struct semaphore *done)
+{
+  struct block_request *request = &cluster->request;
+  size_t i;
+
+  ASSERT (cluster->cnt > 0 && cluster->cnt <= CLUSTER_SIZE);
+
+  for (i = 0; i < cluster->cnt; i++)
+    cluster->data[i] = cluster->buffers[i]->data;
+  request->is_write = is_write;
+  request->sector = cluster->buffers[0]->sector;
+  request->buffers = cluster->data;
+  request->cnt = cluster->cnt;
+  request->complete = block_request_wake;
+  request->aux = done;
+  block_submit (fs_device, request);
+}
+
+/* Waits for the CNT submitted CLUSTERS, whose requests up DONE, to complete
+   and releases their buffers. */
+static void
+finish_clusters (struct cluster clusters[], size_t cnt,
+                 struct semaphore *done)
+{
+  size_t i, j;
+
+  for (i = 0; i < cnt; i++)
+    sema_down (done);
+  for (i = 0; i < cnt; i++)
+    for (j = 0; j < clusters[i].cnt; j++)
+      buffer_release (clusters[i].buffers[j], false);
+}
+
+/* Returns the number of buffers to put in the cache, rounded up to fill
+   whole pages and to divide evenly between the shards. */
+static size_t
+compute_cache_size (void)
+{
+  size_t pool_buffers = palloc_page_cnt (0) * BUFFERS_PER_PAGE;
+  size_t size = cache_size;
+
+  if (cache_size_is_pct)
+    size = pool_buffers * cache_size / 100;
+  if (size > pool_buffers * CACHE_MAX_PCT / 100)
+    size = pool_buffers * CACHE_MAX_PCT / 100;
+  if (size < CACHE_MIN_SIZE)
+    size = CACHE_MIN_SIZE;
+  return ROUND_UP (size, BUFFERS_PER_PAGE * SHARD_CNT);
+}
+
+static int
+dirty_sector_compare (const void *a_, const void *b_)
+{
+  const struct dirty_sector *a = a_;
+  const struct dirty_sector *b = b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+static unsigned
+buffer_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct buffer *buffer = hash_entry (e, struct buffer, hash_elem);
+
+  return hash_int (buffer->sector);
+}
+
+static bool
+buffer_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  struct buffer *a = hash_entry (a_, struct buffer, hash_elem);
+  struct buffer *b = hash_entry (b_, struct buffer, hash_elem);
+
+  return a->sector < b->sector;
+}
+
+/* Least recently used replacement.  Data buffers are evicted before meta
+   data buffers. */
+#define LRU_DATA 0
+#define LRU_META 1
+
+static void
+lru_init (struct cache_shard *shard UNUSED)
+{
+}
+
+static int
+lru_load (struct cache_shard *shard UNUSED, block_sector_t sector UNUSED,
+          bool is_meta)
+{
+  return is_meta ? LRU_META : LRU_DATA;
+}
+
+static struct buffer *
+lru_victim (struct cache_shard *shard)
+{
+  if (!list_empty (&shard->queues[LRU_DATA]))
+    return list_entry (list_front (&shard->queues[LRU_DATA]),
+                       struct buffer, elem);
+  if (!list_empty (&shard->queues[LRU_META]))
+    return list_entry (list_front (&shard->queues[LRU_META]),
+                       struct buffer, elem);
+  return NULL;
+}
+
+static void
+lru_evict (struct cache_shard *shard UNUSED, struct buffer *buffer UNUSED)
+{
+}
+
+/* 2Q replacement, see "2Q: A Low Overhead High Performance Buffer Management
+   Replacement Algorithm" by Johnson and Shasha.  A sector loaded for the 
+   first time goes on the A1in queue, which is evicted from first once it
+   holds more than its share of the shard, so a long sequential read only 
+   displaces other A1in buffers.  Sectors evicted from A1in are remembered in
+   the ghost queue, A1out, and if one is loaded again while it's remembered it
+   goes on the Am queue, which is managed as LRU.  Meta data goes straight on
+   Am. */
+#define TWOQ_A1IN 0
+#define TWOQ_AM   1
+/* The percentage of a shard's buffers A1in can hold before it's evicted
+   from first. */
+#define TWOQ_KIN_PCT  25
+/* The number of sectors remembered in A1out as a percentage of a shard's
+   buffers. */
+#define TWOQ_KOUT_PCT 50
+
+static void
+twoq_init (struct cache_shard *shard)
+{
+  size_t i;
+
+  shard->ghost_cnt = shard->buffer_cnt * TWOQ_KOUT_PCT / 100;
+  if (shard->ghost_cnt == 0)
+    shard->ghost_cnt = 1;
+  shard->ghost_next = 0;
+  shard->ghosts = calloc (shard->ghost_cnt, sizeof *shard->ghosts);
+  if (shard->ghosts == NULL)
+    PANIC ("buffer cache allocation failed");
+  for (i = 0; i < shard->ghost_cnt; i++)
+    shard->ghosts[i].sector = UINT_MAX;
+  hash_init (&shard->ghost_index, ghost_hash, ghost_less, NULL);
+}
+
+static int
+twoq_load (struct cache_shard *shard, block_sector_t sector, bool is_meta)
+{
+  struct ghost key;
+  struct ghost *ghost;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&shard->ghost_index, &key.hash_elem);
+  if (e != NULL)
+    {
+      ghost = hash_entry (e, struct ghost, hash_elem);
+      hash_delete (&shard->ghost_index, e);
+      ghost->sector = UINT_MAX;
+      return TWOQ_AM;
+    }
+  return is_meta ? TWOQ_AM : TWOQ_A1IN;
+}
+
+static struct buffer *
+twoq_victim (struct cache_shard *shard)
+{
+  struct list *a1in = &shard->queues[TWOQ_A1IN];
+  struct list *am = &shard->queues[TWOQ_AM];
+
+  if (!list_empty (a1in)
+      && (shard->queue_size[TWOQ_A1IN]
+          > shard->buffer_cnt * TWOQ_KIN_PCT / 100 || list_empty (am)))
+    return list_entry (list_front (a1in), struct buffer, elem);
+  if (!list_empty (am))
+    return list_entry (list_front (am), struct buffer, elem);
+  return NULL;
+}
+
+/* Remembers the sectors of buffers evicted from A1in, forgetting the
+   oldest remembered sector if A1out is full. */
+static void
+twoq_evict (struct cache_shard *shard, struct buffer *buffer)
+{
+  struct ghost *ghost;
+
+  if (buffer->queue != TWOQ_A1IN)
+    return;
+  ghost = &shard->ghosts[shard->ghost_next];
+  shard->ghost_next = (shard->ghost_next + 1) % shard->ghost_cnt;
+  if (ghost->sector != UINT_MAX)
+    hash_delete (&shard->ghost_index, &ghost->hash_elem);
+  ghost->sector = buffer->sector;
+  if (hash_insert (&shard->ghost_index, &ghost->hash_elem) != NULL)
+    ghost->sector = UINT_MAX;
+}
+
+static unsigned
+ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct ghost *ghost = hash_entry (e, struct ghost, hash_elem);
+
+  return hash_int (ghost->sector);
+}
+
+static bool
+ghost_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  struct ghost *a = hash_entry (a_, struct ghost, hash_elem);
+  struct ghost *b = hash_entry (b_, struct ghost, hash_elem);
+
+  return a->sector < b->sector;
+}
@@ -2,14 +2,25 @@
 #define FILESYS_BUFFER_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <list.h>
+#include <hash.h>
 #include "threads/synch.h"
 #include "devices/block.h"
 
+struct cache_shard;
+
 struct buffer
 {
+  /* The cache shard that the buffer belongs to. */
+  struct cache_shard *shard;
   /* Status flags.  See buffer.c. */
   uint8_t flags;
+  /* The replacement policy queue the buffer belongs to. */
+  uint8_t queue;
+  /* When the buffer became dirty, in timer ticks. */
+  int64_t dirty_ticks;
   /* The disk sector for the buffer. */
   block_sector_t sector;
   /* The sector that's currently being evicted if this is not UINT_MAX. */
@@ -20,14 +31,22 @@ struct buffer
   struct condition available;
   /* If the buffer is being evicted, wait on evicting. */
   struct condition evicted;
-  uint8_t data[BLOCK_SECTOR_SIZE];
+  /* The buffer's BLOCK_SECTOR_SIZE bytes of sector data. */
+  uint8_t *data;
+  /* Element in the sector index. */
+  struct hash_elem hash_elem;
+  /* Element in an LRU list if the buffer is available for eviction or in
+     the evicting list if it's being evicted. */
   struct list_elem elem;
 };
 
+void buffers_configure (size_t size, bool is_pct);
+bool buffers_set_policy (const char *name);
 void buffers_init (void);
 void buffers_done (void);
 struct buffer *buffer_acquire (block_sector_t sector, bool is_meta);
+struct buffer *buffer_acquire_new (block_sector_t sector, bool is_meta);
 void buffer_release (struct buffer *buffer, bool dirty);
-void buffer_read_ahead (block_sector_t sector, bool is_meta);
+void buffer_read_ahead (block_sector_t sector, size_t cnt, bool is_meta);
 
 #endif /* filesys/buffer.h */
@@ -1,10 +1,12 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 
@@ -16,12 +18,278 @@ struct dir_entry
   bool in_use;                        /* In use or free? */
 };
 
+/* Directories created by dir_create() are hashed (INODE_HASHED_DIR):
+   their entries are divided into buckets of BUCKET_ENTRIES
+   consecutive entries, and a name can only be stored in the bucket
+   picked by its hash, so that looking it up reads at most two
+   sectors however big the directory is.  "." and ".." are always
+   the first two entries of bucket 0.
+
+   The buckets grow by linear hashing.  With N buckets, and 2**M the
+   smallest power of 2 not less than N, a name with hash H belongs
+   to logical bucket H mod 2**M.  Logical buckets below N are
+   physical buckets; the others still share the bucket 2**(M-1)
+   below them.  Whenever a name's bucket is full, bucket N is added
+   and the entries of the bucket it shared are moved to it, each
+   to the slot it had.  So a split only ever writes two buckets.
+
+   The number of entries other than "." and ".." is kept in the
+   inode's flags, from INODE_DIR_CNT_SHIFT up.
+
+   Directories without the flag, written before hashing was added,
+   are still searched from start to end. */
+#define BUCKET_ENTRIES 25
+#define BUCKET_SIZE ((off_t) (BUCKET_ENTRIES * sizeof (struct dir_entry)))
+
+/* Logical bucket numbers have at most this many bits, because
+   dir_readdir() keeps one in the file position. */
+#define BUCKET_BITS_MAX 14
+
+/* Entries are always this many bytes apart, in either format. */
+#define ENTRY_SIZE ((off_t) sizeof (struct dir_entry))
+
+/* Directory entry cache.  Remembers the results of recent lookups,
+   including names that were not found, keyed by the sector of the
+   directory and the name, so that walking the same paths again
+   doesn't read the directories.  dir_add() and dir_remove() update
+   it, and like lookups they are called with the directory locked,
+   so it can't disagree with the directory. */
+#define DCACHE_SETS 128                 /* Number of sets. */
+#define DCACHE_WAYS 4                   /* Number of entries per set. */
+
+struct dcache_entry
+  {
+    block_sector_t dir;                 /* Sector of the directory. */
+    block_sector_t inode_sector;        /* Sector of the file, if found. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    bool in_use;                        /* In use or free? */
+    bool found;                         /* Is NAME in the directory? */
+  };
+
+static struct dcache_entry dcache[DCACHE_SETS][DCACHE_WAYS];
+static int dcache_hand[DCACHE_SETS];    /* Next way to replace in a set. */
+static struct lock dcache_lock;         /* Protects the cache. */
+static int dcache_hits, dcache_misses;
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  lock_init (&dcache_lock);
+}
+
+/* Prints statistics about the directory entry cache. */
+void
+dir_print_stats (void)
+{
+  printf ("dentry cache: %d hits, %d misses\n", dcache_hits, dcache_misses);
+}
+
+/* Returns the index of the entry cache set for NAME in directory
+   DIR. */
+static unsigned
+dcache_set (block_sector_t dir, const char *name)
+{
+  return (hash_string (name) ^ hash_int (dir)) % DCACHE_SETS;
+}
+
+/* Returns the cached entry for NAME in directory DIR, or a null
+   pointer if there is none.  The caller must hold dcache_lock. */
+static struct dcache_entry *
+dcache_find (block_sector_t dir, const char *name)
+{
+  struct dcache_entry *set = dcache[dcache_set (dir, name)];
+  int i;
+
+  ASSERT (lock_held_by_current_thread (&dcache_lock));
+
+  for (i = 0; i < DCACHE_WAYS; i++)
+    if (set[i].in_use && set[i].dir == dir && !strcmp (set[i].name, name))
+      return &set[i];
+  return NULL;
+}
+
+/* Records in the entry cache that NAME in directory DIR refers to
+   the inode in INODE_SECTOR if FOUND is true, or that there is no
+   such name if FOUND is false. */
+static void
+dcache_insert (block_sector_t dir, const char *name, bool found,
+               block_sector_t inode_sector)
+{
+  struct dcache_entry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+  lock_acquire (&dcache_lock);
+  d = dcache_find (dir, name);
+  if (d == NULL)
+    {
+      unsigned idx = dcache_set (dir, name);
+      struct dcache_entry *set = dcache[idx];
+      int i;
+
+      for (i = 0; i < DCACHE_WAYS; i++)
+        if (!set[i].in_use)
+          break;
+      if (i == DCACHE_WAYS)
+        {
+          i = dcache_hand[idx];
+          dcache_hand[idx] = (i + 1) % DCACHE_WAYS;
+        }
+      d = &set[i];
+      d->in_use = true;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+    }
+  d->found = found;
+  d->inode_sector = inode_sector;
+  lock_release (&dcache_lock);
+}
+
+/* Drops the cached entry for NAME in directory DIR, if any. */
+static void
+dcache_remove (block_sector_t dir, const char *name)
+{
+  struct dcache_entry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (dir, name);
+  if (d != NULL)
+    d->in_use = false;
+  lock_release (&dcache_lock);
+}
+
+/* Drops all cached entries for directory DIR. */
+static void
+dcache_remove_dir (block_sector_t dir)
+{
+  int i, j;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SETS; i++)
+    for (j = 0; j < DCACHE_WAYS; j++)
+      if (dcache[i][j].dir == dir)
+        dcache[i][j].in_use = false;
+  lock_release (&dcache_lock);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
+  struct inode *inode;
+  size_t bucket_cnt = 1;
+
+  /* SECTOR may have held a directory that has been removed. */
+  dcache_remove_dir (sector);
+
+  /* Leave the buckets half full, so that adding the entries doesn't
+     immediately split them. */
+  while (bucket_cnt * BUCKET_ENTRIES < 2 * (entry_cnt + 2))
+    bucket_cnt *= 2;
+  if (!inode_create (sector, bucket_cnt * BUCKET_SIZE, true))
+    return false;
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  inode_set_flags (inode, INODE_HASHED_DIR);
+  inode_close (inode);
+  return true;
+}
+
+/* Returns true if NAME is "." or "..". */
+static bool
+is_dot (const char *name)
+{
+  return !strcmp (name, ".") || !strcmp (name, "..");
+}
+
+/* Returns a hash value for NAME.  The low bits of hash_string()
+   depend only on the low bits of each character, so fold the high
+   bits into them before they are used to pick a bucket. */
+static unsigned
+name_hash (const char *name)
+{
+  unsigned hash = hash_string (name);
+  return hash ^ (hash >> 16);
+}
+
+/* Returns the number of buckets in hashed directory DINODE. */
+static size_t
+bucket_cnt (struct inode *dinode)
+{
+  return inode_length (dinode) / BUCKET_SIZE;
+}
+
+/* Returns the number of bits in the logical bucket numbers of a
+   hashed directory with CNT buckets. */
+static unsigned
+bucket_bits (size_t cnt)
+{
+  unsigned bits = 0;
+
+  while ((size_t) 1 << bits < cnt)
+    bits++;
+  return bits;
+}
+
+/* Returns the physical bucket that holds logical bucket LOGICAL
+   of a hashed directory with CNT buckets. */
+static size_t
+physical_bucket (size_t logical, size_t cnt)
+{
+  size_t shared = logical - ((size_t) 1 << bucket_bits (cnt)) / 2;
+
+  return logical < cnt ? logical : shared;
+}
+
+/* Returns the logical bucket, among 2**BITS, of a name with hash
+   value HASH. */
+static size_t
+logical_bucket (unsigned hash, unsigned bits)
+{
+  return hash & (((size_t) 1 << bits) - 1);
+}
+
+/* Returns the number of entries other than "." and ".." in hashed
+   directory DINODE. */
+static size_t
+entry_cnt (struct inode *dinode)
+{
+  return inode_get_flags (dinode) >> INODE_DIR_CNT_SHIFT;
+}
+
+/* Adds DELTA to the number of entries in hashed directory DINODE. */
+static void
+adjust_entry_cnt (struct inode *dinode, int delta)
+{
+  inode_replace_flags (dinode, ~0u << INODE_DIR_CNT_SHIFT,
+                       (entry_cnt (dinode) + delta) << INODE_DIR_CNT_SHIFT);
+}
+
+/* Sets *STARTP and *ENDP to the byte offsets of the first entry
+   of the bucket for NAME in hashed directory DINODE and of the end
+   of that bucket.  "." and ".." have their own entries. */
+static void
+name_bucket (struct inode *dinode, const char *name,
+             off_t *startp, off_t *endp)
+{
+  size_t cnt = bucket_cnt (dinode);
+  size_t bucket;
+
+  if (is_dot (name))
+    {
+      *startp = name[1] == '.' ? ENTRY_SIZE : 0;
+      *endp = *startp + ENTRY_SIZE;
+      return;
+    }
+  bucket = physical_bucket (logical_bucket (name_hash (name),
+                                            bucket_bits (cnt)), cnt);
+  *startp = bucket * BUCKET_SIZE;
+  *endp = *startp + BUCKET_SIZE;
+  if (bucket == 0)
+    *startp += 2 * ENTRY_SIZE;
 }
 
 /* Searches DIR for a file with the given NAME.
@@ -34,12 +302,19 @@ lookup (struct inode *dinode, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
-  size_t ofs;
+  off_t ofs, end;
   
   ASSERT (dinode != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dinode, &e, sizeof e, ofs) == sizeof e;
+  if (inode_get_flags (dinode) & INODE_HASHED_DIR)
+    name_bucket (dinode, name, &ofs, &end);
+  else
+    {
+      ofs = 0;
+      end = inode_length (dinode);
+    }
+  for (; ofs < end && inode_read_at (dinode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
     {
       if (e.in_use && !strcmp (name, e.name)) 
@@ -54,6 +329,76 @@ lookup (struct inode *dinode, const char *name,
   return false;
 }
 
+/* Adds a bucket to hashed directory DINODE, and moves the entries
+   of the bucket it splits from whose names belong in the new one.
+   Returns true if successful, false on failure. */
+static bool
+split_bucket (struct inode *dinode)
+{
+  size_t cnt = bucket_cnt (dinode);
+  unsigned bits = bucket_bits (cnt + 1);
+  size_t from = cnt - ((size_t) 1 << bits) / 2;
+  struct dir_entry e, empty;
+  off_t ofs, end, new_ofs;
+
+  if (cnt >= (size_t) 1 << BUCKET_BITS_MAX)
+    return false;
+
+  /* Extend the directory.  The new bucket reads back as empty. */
+  memset (&empty, 0, sizeof empty);
+  if (inode_write_at (dinode, &empty, sizeof empty,
+                      (cnt + 1) * BUCKET_SIZE - ENTRY_SIZE) != ENTRY_SIZE)
+    return false;
+
+  /* Entries keep their slots, which dir_readdir() relies on. */
+  ofs = from * BUCKET_SIZE + (from == 0 ? 2 * ENTRY_SIZE : 0);
+  end = (from + 1) * BUCKET_SIZE;
+  new_ofs = cnt * BUCKET_SIZE + (ofs - from * BUCKET_SIZE);
+  for (; ofs < end; ofs += ENTRY_SIZE, new_ofs += ENTRY_SIZE)
+    {
+      if (inode_read_at (dinode, &e, sizeof e, ofs) != ENTRY_SIZE)
+        return false;
+      if (!e.in_use || logical_bucket (name_hash (e.name), bits) != cnt)
+        continue;
+      if (inode_write_at (dinode, &e, sizeof e, new_ofs) != ENTRY_SIZE
+          || inode_write_at (dinode, &empty, sizeof empty, ofs)
+             != ENTRY_SIZE)
+        return false;
+    }
+  return true;
+}
+
+/* Searches DIR for a file with the given NAME, first in the
+   entry cache.  If successful, returns true and sets *SECTORP to
+   the sector of the file's inode, otherwise returns false. */
+static bool
+find (struct inode *dinode, const char *name, block_sector_t *sectorp)
+{
+  block_sector_t dir = inode_get_inumber (dinode);
+  struct dcache_entry *d;
+  struct dir_entry e;
+  bool found;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (dir, name);
+  if (d != NULL)
+    {
+      dcache_hits++;
+      found = d->found;
+      *sectorp = d->inode_sector;
+      lock_release (&dcache_lock);
+      return found;
+    }
+  dcache_misses++;
+  lock_release (&dcache_lock);
+
+  found = lookup (dinode, name, &e, NULL);
+  if (found)
+    *sectorp = e.inode_sector;
+  dcache_insert (dir, name, found, found ? e.inode_sector : 0);
+  return found;
+}
+
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
@@ -62,19 +407,61 @@ bool
 dir_lookup (struct inode *dinode, const char *name,
             struct inode **inode) 
 {
-  struct dir_entry e;
+  block_sector_t sector;
 
   ASSERT (dinode != NULL);
   ASSERT (name != NULL);
   ASSERT (inode != NULL);
 
-  if (lookup (dinode, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  if (find (dinode, name, &sector))
+    *inode = inode_open (sector);
   else
     *inode = NULL;
   return *inode != NULL;
 }
 
+/* Sets *OFSP to the offset of a free slot in NAME's bucket in hashed
+   directory DINODE and returns true, or returns false if the bucket
+   is full. */
+static bool
+find_slot (struct inode *dinode, const char *name, off_t *ofsp)
+{
+  struct dir_entry e;
+  off_t ofs, end;
+
+  name_bucket (dinode, name, &ofs, &end);
+  for (; ofs < end; ofs += sizeof e)
+    if (inode_read_at (dinode, &e, sizeof e, ofs) != sizeof e || !e.in_use)
+      {
+        *ofsp = ofs;
+        return true;
+      }
+  return false;
+}
+
+/* Adds buckets to directory DINODE until NAME's bucket has a free
+   slot.  Each bucket is added in a journal step of its own, so this
+   must come before anything else the operation changes, which can
+   then add NAME without making the operation too big for the log
+   however many buckets it took.  DINODE must have been locked
+   before the operation began.  Returns true if successful, false
+   if the directory can't grow. */
+bool
+dir_make_room (struct inode *dinode, const char *name)
+{
+  off_t ofs;
+
+  if (!(inode_get_flags (dinode) & INODE_HASHED_DIR))
+    return true;
+  while (!find_slot (dinode, name, &ofs))
+    {
+      if (!split_bucket (dinode))
+        return false;
+      journal_restart ();
+    }
+  return true;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
@@ -96,28 +483,47 @@ dir_add (struct inode *dinode, const char *name, block_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
-  if (lookup (dinode, name, NULL, NULL))
+  if (find (dinode, name, &e.inode_sector))
     {
       goto done;
     }
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
+  if (inode_get_flags (dinode) & INODE_HASHED_DIR)
+    {
+      /* Set OFS to offset of a free slot in NAME's bucket,
+         adding buckets until there is one, unless dir_make_room()
+         already has. */
+      while (!find_slot (dinode, name, &ofs))
+        if (!split_bucket (dinode))
+          goto done;
+    }
+  else
+    {
+      /* Set OFS to offset of free slot.
+         If there are no free slots, then it will be set to the
+         current end-of-file.
      
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dinode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+         inode_read_at() will only return a short read at end of file.
+         Otherwise, we'd need to verify that we didn't get a short
+         read due to something intermittent such as low memory. */
+      for (ofs = 0; inode_read_at (dinode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e) 
+        if (!e.in_use)
+          break;
+    }
 
   /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at (dinode, &e, sizeof e, ofs) == sizeof e;
+  if (success && (inode_get_flags (dinode) & INODE_HASHED_DIR)
+      && !is_dot (name))
+    adjust_entry_cnt (dinode, 1);
+  if (success)
+    dcache_insert (inode_get_inumber (dinode), name, true, inode_sector);
+  else
+    dcache_remove (inode_get_inumber (dinode), name);
 
  done:
   return success;
@@ -142,10 +548,97 @@ dir_remove (struct inode *dinode, const char *name)
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dinode, &e, sizeof e, ofs) != sizeof e)
-    return false;
+    {
+      dcache_remove (inode_get_inumber (dinode), name);
+      return false;
+    }
+  if ((inode_get_flags (dinode) & INODE_HASHED_DIR) && !is_dot (name))
+    adjust_entry_cnt (dinode, -1);
+  dcache_insert (inode_get_inumber (dinode), name, false, 0);
   return true;
 }
 
+/* A reader of a hashed directory visits the slots in order, and
+   in each slot the logical buckets in an order that stays the same
+   as the directory grows: with 2**M logical buckets, bucket V comes
+   at index R, the M-bit reversal of V, and once there are 2**(M+1),
+   V and V + 2**M, which split from it, come at 2R and 2R + 1.  As
+   entries keep their slots when buckets split, a reader at index R
+   of slot S has returned exactly the names at earlier slots and at
+   earlier indexes in slot S, however much the directory has grown
+   since, so it neither skips nor repeats a name that stays in the
+   directory.  Its position (S, M, R) is kept in the file
+   position. */
+#define CURSOR_BITS_SHIFT BUCKET_BITS_MAX
+#define CURSOR_SLOT_SHIFT (BUCKET_BITS_MAX + 4)
+
+/* Returns the file position of a reader at index INDEX of SLOT with
+   2**BITS logical buckets. */
+static off_t
+make_cursor (size_t slot, unsigned bits, size_t index)
+{
+  if (index == (size_t) 1 << bits)
+    {
+      slot++;
+      index = 0;
+    }
+  return ((off_t) slot << CURSOR_SLOT_SHIFT)
+         | ((off_t) bits << CURSOR_BITS_SHIFT) | index;
+}
+
+/* Returns the BITS-bit reversal of X. */
+static size_t
+reverse_bits (size_t x, unsigned bits)
+{
+  size_t r = 0;
+  unsigned i;
+
+  for (i = 0; i < bits; i++, x >>= 1)
+    r = (r << 1) | (x & 1);
+  return r;
+}
+
+/* Reads the next entry of hashed directory DINODE, open as FILE,
+   into NAME, as described above. */
+static bool
+readdir_hashed (struct inode *dinode, struct file *file,
+                char name[NAME_MAX + 1])
+{
+  off_t pos = file_tell (file);
+  size_t cnt = bucket_cnt (dinode);
+  unsigned bits = bucket_bits (cnt);
+  size_t slot = pos >> CURSOR_SLOT_SHIFT;
+  unsigned pos_bits = (pos >> CURSOR_BITS_SHIFT) & 0xf;
+  size_t index = pos & ((1 << BUCKET_BITS_MAX) - 1);
+  struct dir_entry e;
+
+  /* Directories never shrink. */
+  ASSERT (pos_bits <= bits);
+  index <<= bits - pos_bits;
+  for (; slot < BUCKET_ENTRIES; slot++, index = 0)
+    for (; index < (size_t) 1 << bits; index++)
+      {
+        size_t logical = reverse_bits (index, bits);
+        size_t bucket = physical_bucket (logical, cnt);
+
+        /* Skip '.' and '..'. */
+        if (bucket == 0 && slot < 2)
+          continue;
+        if (inode_read_at (dinode, &e, sizeof e,
+                           bucket * BUCKET_SIZE + slot * ENTRY_SIZE)
+            != sizeof e)
+          return false;
+        if (e.in_use && logical_bucket (name_hash (e.name), bits) == logical)
+          {
+            strlcpy (name, e.name, NAME_MAX + 1);
+            file_seek (file, make_cursor (slot, bits, index + 1));
+            return true;
+          }
+      }
+  file_seek (file, make_cursor (BUCKET_ENTRIES, 0, 0));
+  return false;
+}
+
 /* Reads the next directory entry in DIR from the offset and stores 
    the name in NAME.  Updates the offset and returns true if successful, 
    false if the directory contains no more entries. */
@@ -161,17 +654,22 @@ dir_readdir (struct file *file, char name[NAME_MAX + 1])
 
   dinode = file_get_inode (file);
 
-  /* Skip '.' and '..'. */
-  if (file_tell (file) == 0)
-    file_seek (file, 2 * sizeof e);
   inode_lock (dinode);
-  while (file_read (file, &e, sizeof e) == sizeof e) 
+  if (inode_get_flags (dinode) & INODE_HASHED_DIR)
+    success = readdir_hashed (dinode, file, name);
+  else
     {
-      if (e.in_use)
+      /* Skip '.' and '..'. */
+      if (file_tell (file) == 0)
+        file_seek (file, 2 * sizeof e);
+      while (file_read (file, &e, sizeof e) == sizeof e) 
         {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          success = true;
-          break;
+          if (e.in_use)
+            {
+              strlcpy (name, e.name, NAME_MAX + 1);
+              success = true;
+              break;
+            }
         }
     }
   inode_unlock (dinode);
@@ -188,6 +686,9 @@ dir_is_empty (struct inode *dinode)
 
   ASSERT (dinode != NULL);
 
+  if (inode_get_flags (dinode) & INODE_HASHED_DIR)
+    return entry_cnt (dinode) == 0;
+
   /* Skip '.' and '..'. */
   for (ofs = 2 * sizeof e;
        inode_read_at (dinode, &e, sizeof e, ofs) == sizeof e; ofs += sizeof e) 
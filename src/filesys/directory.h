@@ -14,10 +14,13 @@
 struct inode;
 struct file;
 
+void dir_init (void);
+void dir_print_stats (void);
 bool dir_create (block_sector_t sector, size_t entry_cnt);
 
 /* Reading and writing. */
 bool dir_lookup (struct inode *dinode, const char *name, struct inode **inode);
+bool dir_make_room (struct inode *dinode, const char *name);
 bool dir_add (struct inode *dinode, const char *name,
               block_sector_t inode_sector);
 bool dir_remove (struct inode *dinode, const char *name);
@@ -3,14 +3,27 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Read-ahead window sizes, in sectors.  The window starts at
+   READ_AHEAD_MIN when a file is read sequentially and doubles
+   with each further sequential read up to READ_AHEAD_MAX. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 64
+
 /* An open file. */
 struct file 
   {
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Sequential read detection. */
+    off_t ra_next;              /* Offset a sequential read starts at. */
+    off_t ra_end;               /* Read ahead already queued up to here. */
+    int ra_window;              /* Read-ahead window in sectors. */
   };
 
+static void read_ahead (struct file *, off_t ofs, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +36,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -41,6 +57,23 @@ file_reopen (struct file *file)
   return file_open (inode_reopen (file->inode));
 }
 
+/* Opens and returns a new file for the same inode as FILE, at the
+   same position, that denies writes if FILE does.  Returns a null
+   pointer if unsuccessful. */
+struct file *
+file_dup (struct file *file) 
+{
+  struct file *dup = file_reopen (file);
+
+  if (dup != NULL)
+    {
+      dup->pos = file->pos;
+      if (file->deny_write)
+        file_deny_write (dup);
+    }
+  return dup;
+}
+
 /* Closes FILE. */
 void
 file_close (struct file *file) 
@@ -69,6 +102,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
 
   return bytes_read;
@@ -82,7 +116,10 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  read_ahead (file, file_ofs, bytes_read);
+
+  return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -164,6 +201,11 @@ file_seek (struct file *file, off_t new_pos)
   if (new_pos >= MAX_FILE_SIZE)
     new_pos = MAX_FILE_SIZE - 1;
   file->pos = new_pos;
+
+  /* Start read-ahead over, as if FILE had just been opened here. */
+  file->ra_next = new_pos;
+  file->ra_end = new_pos;
+  file->ra_window = 0;
 }
 
 /* Returns the current position in FILE as a byte offset from the
@@ -182,3 +224,37 @@ file_is_dir (struct file *file)
 {
   return inode_is_dir (file->inode);
 }
+
+/* Called after SIZE bytes are read from FILE at offset OFS.  If
+   the read continued where the previous one left off, grows the
+   read-ahead window and queues the part of the window past what
+   has already been queued.  Otherwise the access isn't
+   sequential, so the window is reset. */
+static void
+read_ahead (struct file *file, off_t ofs, off_t size)
+{
+  off_t end;
+
+  if (size <= 0)
+    return;
+  if (ofs != file->ra_next)
+    {
+      file->ra_window = 0;
+      file->ra_next = ofs + size;
+      file->ra_end = ofs + size;
+      return;
+    }
+  file->ra_next = ofs + size;
+  if (file->ra_window == 0)
+    file->ra_window = READ_AHEAD_MIN;
+  else if (file->ra_window < READ_AHEAD_MAX)
+    file->ra_window *= 2;
+  if (file->ra_end < file->ra_next)
+    file->ra_end = file->ra_next;
+  end = file->ra_next + file->ra_window * BLOCK_SECTOR_SIZE;
+  if (end > file->ra_end)
+    {
+      inode_read_ahead (file->inode, file->ra_end, end - file->ra_end);
+      file->ra_end = end;
+    }
+}
@@ -8,6 +8,7 @@
 #include "filesys/directory.h"
 #include "filesys/buffers.h"
 #include "filesys/path.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 #include "devices/input.h"
 
@@ -28,19 +29,28 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   buffers_init ();
+  journal_init ();
   inode_init ();
+  dir_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
+  else
+    {
+      journal_recover ();
+      inode_inherit_layout (ROOT_DIR_SECTOR);
+    }
 
   free_map_open ();
 
   /* Create the initial links in the root directory. */
   dinode = inode_open (ROOT_DIR_SECTOR);
   inode_lock (dinode);
+  journal_begin ();
   dir_add (dinode, ".", ROOT_DIR_SECTOR);
   dir_add (dinode, "..", ROOT_DIR_SECTOR);
+  journal_end ();
   inode_unlock (dinode);
   thread_current ()->cwd = dinode;
 }
@@ -50,6 +60,10 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_print_stats ();
+  dir_print_stats ();
+  inode_done ();
+  journal_done ();
   buffers_done ();
   free_map_close ();
 }
@@ -71,8 +85,12 @@ filesys_create (const char *path, off_t initial_size)
   dinode = path_lookup_parent (path, name);
   if (dinode == NULL)
     return false;
+  /* Directories are locked before journal operations begin, see
+     filesys/journal.c. */
   inode_lock (dinode);
-  if (!free_map_allocate (1, &inode_sector)
+  journal_begin ();
+  if (!dir_make_room (dinode, name)
+      || !free_map_allocate (1, &inode_sector)
       || !inode_create (inode_sector, initial_size, false)
       || !dir_add (dinode, name, inode_sector))
     goto done;
@@ -81,6 +99,7 @@ filesys_create (const char *path, off_t initial_size)
  done:
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
+  journal_end ();
   inode_unlock (dinode);
   inode_close (dinode);
   return success;
@@ -143,7 +162,9 @@ filesys_remove (const char *path)
          atomically to prevent another process from adding a directory after 
          the empty check.  In order to do this two locks need to be acquired,
          a lock for the parent and for the directory.  This will not lead to
-         deadlock because locks are always acquired in the same order. */
+         deadlock because locks are always acquired in the same order.  Both
+         are acquired before the journal operation begins, see
+         filesys/journal.c. */
       inode_lock (inode);
       if (!dir_is_empty (inode))
         {
@@ -153,18 +174,19 @@ filesys_remove (const char *path)
     }
   else if (path_has_trailing_slash (path))
     goto done;
+  journal_begin ();
   dir_remove (dinode, name);
   /* Remove a directory with the lock held in case another thread is reading the
      deleted directory. */
   inode_remove (inode);
+  journal_end ();
   if (is_dir)
     inode_unlock (inode);
   success = true;
   
  done:
-  if (inode != NULL)
-    inode_close (inode);
   inode_unlock (dinode);
+  inode_close (inode);
   inode_close (dinode);
   return success;
 }
@@ -345,9 +367,13 @@ filesys_mkdir (const char *path, off_t initial_size)
   dinode = path_lookup_parent (path, name);
   if (dinode == NULL)
     return false;
+  /* Directories are locked before journal operations begin, see
+     filesys/journal.c. */
   inode_lock (dinode);
-  if (!free_map_allocate (1, &inode_sector)
-      || !inode_create (inode_sector, initial_size, true))
+  journal_begin ();
+  if (!dir_make_room (dinode, name)
+      || !free_map_allocate (1, &inode_sector)
+      || !dir_create (inode_sector, initial_size))
     goto done;
   inode = inode_open (inode_sector);
   if (inode == NULL)
@@ -369,6 +395,7 @@ filesys_mkdir (const char *path, off_t initial_size)
     }
   if (inode != NULL)
     inode_close (inode);
+  journal_end ();
   inode_unlock (dinode);
   inode_close (dinode);
   return success;
@@ -426,9 +453,13 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_create ();
+  journal_begin ();
   free_map_create ();
+  journal_restart ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_end ();
   free_map_close ();
   printf ("done.\n");
 }
@@ -1,12 +1,37 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdint.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Number of sectors summarized by each free count. */
+#define GROUP_SECTORS 1024
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects the free map. */
+
+/* Number of free sectors in each group of GROUP_SECTORS sectors,
+   so that searches can skip over full groups without looking at
+   their bits. */
+static uint16_t *group_free;
+static size_t group_cnt;
+
+/* Where free_map_allocate() starts looking, just past the last
+   sectors it allocated. */
+static block_sector_t next_fit;
+
+static void count_free (void);
+static size_t find_run (size_t start, size_t end, size_t cnt,
+                        size_t *longest_start, size_t *longest_cnt);
+static void set_sectors (block_sector_t sector, size_t cnt, bool used);
+static bool write_bits (block_sector_t sector, size_t cnt);
 
 /* Initializes the free map. */
 void
@@ -15,38 +40,232 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("free map summary allocation failed");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  count_free ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The search picks up where the last
+   one left off, wrapping around to the start of the disk.
    Returns true if successful, false if not enough consecutive
    sectors were available or if the free_map file could not be
    written. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  size_t size = bitmap_size (free_map);
+  size_t sector;
+  size_t longest_start, longest_cnt = 0;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (next_fit >= size)
+    next_fit = 0;
+  sector = find_run (next_fit, size, cnt, &longest_start, &longest_cnt);
+  if (sector == BITMAP_ERROR)
+    sector = find_run (0, next_fit, cnt, &longest_start, &longest_cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      set_sectors (sector, cnt, true);
+      if (write_bits (sector, cnt))
+        next_fit = sector + cnt;
+      else
+        {
+          set_sectors (sector, cnt, false);
+          sector = BITMAP_ERROR;
+        }
     }
+  lock_release (&free_map_lock);
+  journal_end ();
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT consecutive sectors from the free map,
+   preferring sectors at or after HINT, and stores the first into
+   *SECTORP.  If HINT itself is free the run starts there, so a
+   file that grows can stay contiguous.  Otherwise the first run
+   of CNT sectors after HINT is used, wrapping around to the start
+   of the disk, or the longest shorter run if there's none.  
+   Returns the number of sectors allocated, which is 0 if the disk
+   is full or the free_map file could not be written. */
+size_t
+free_map_allocate_near (block_sector_t hint, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t sector;
+  size_t allocated = cnt;
+
+  ASSERT (cnt > 0);
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (hint >= size)
+    hint = 0;
+  if (!bitmap_test (free_map, hint))
+    {
+      sector = hint;
+      allocated = bitmap_find (free_map, hint, 
+                               cnt < size - hint ? cnt : size - hint,
+                               true) - hint;
+    }
+  else
+    {
+      size_t longest_start = BITMAP_ERROR, longest_cnt = 0;
+
+      sector = find_run (hint, size, cnt, &longest_start, &longest_cnt);
+      if (sector == BITMAP_ERROR)
+        sector = find_run (0, hint, cnt, &longest_start, &longest_cnt);
+      if (sector == BITMAP_ERROR && longest_cnt > 0)
+        {
+          sector = longest_start;
+          allocated = longest_cnt;
+        }
+    }
+  if (sector != BITMAP_ERROR)
+    {
+      set_sectors (sector, allocated, true);
+      if (!write_bits (sector, allocated))
+        {
+          set_sectors (sector, allocated, false);
+          sector = BITMAP_ERROR;
+        }
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
+  if (sector == BITMAP_ERROR)
+    return 0;
+  *sectorp = sector;
+  return allocated;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  If the
+   journal still has to write any of them in place, that happens
+   once it has. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  if (journal_defer_release (sector, cnt))
+    return;
+  journal_begin ();
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  set_sectors (sector, cnt, false);
+  write_bits (sector, cnt);
+  lock_release (&free_map_lock);
+  journal_end ();
+}
+
+/* Returns the first sector of the first run of CNT free sectors 
+   that starts between START and END, exclusive, or BITMAP_ERROR if
+   there's none.  Full groups of sectors are skipped using their 
+   free counts, and the rest is scanned a word at a time.  Runs 
+   that are too short are compared against the longest run seen 
+   so far, whose first sector and length are kept in 
+   *LONGEST_START and *LONGEST_CNT. */
+static size_t
+find_run (size_t start, size_t end, size_t cnt, size_t *longest_start,
+          size_t *longest_cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t sector = start;
+  size_t run_end, group_end;
+
+  while (sector < end)
+    {
+      /* Skip full groups. */
+      if (group_free[sector / GROUP_SECTORS] == 0)
+        {
+          sector = ROUND_DOWN (sector, GROUP_SECTORS) + GROUP_SECTORS;
+          continue;
+        }
+
+      /* Find the next free sector in this group. */
+      group_end = ROUND_DOWN (sector, GROUP_SECTORS) + GROUP_SECTORS;
+      if (group_end > end)
+        group_end = end;
+      sector = bitmap_find (free_map, sector, group_end - sector, false);
+      if (sector == group_end)
+        continue;
+
+      /* Measure the run of free sectors it starts, which may go on
+         into the following groups. */
+      run_end = bitmap_find (free_map, sector,
+                             cnt < size - sector ? cnt : size - sector, true);
+      if (run_end - sector >= cnt)
+        return sector;
+      if (run_end - sector > *longest_cnt)
+        {
+          *longest_start = sector;
+          *longest_cnt = run_end - sector;
+        }
+      sector = run_end;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks the CNT sectors starting at SECTOR as used if USED is
+   true or as free otherwise, keeping the group free counts up to
+   date. */
+static void
+set_sectors (block_sector_t sector, size_t cnt, bool used)
+{
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  while (cnt > 0)
+    {
+      size_t group = sector / GROUP_SECTORS;
+      size_t group_left = (group + 1) * GROUP_SECTORS - sector;
+      size_t n = cnt < group_left ? cnt : group_left;
+
+      if (used)
+        group_free[group] -= n;
+      else
+        group_free[group] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Recomputes the free count of every group from the bitmap. */
+static void
+count_free (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t group;
+
+  for (group = 0; group < group_cnt; group++)
+    {
+      size_t start = group * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+
+      group_free[group] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* Writes the part of the free map that holds the bits for the CNT
+   sectors starting at SECTOR to the free map file.  Only the file
+   sectors that changed are rewritten, and they go through the
+   buffer cache, so repeated changes to the same part of the map
+   are written to disk together by the cache's write-back.  Until
+   the free map file exists there's nothing to write.  Returns 
+   true if successful.  Callers begin a journal operation before
+   taking free_map_lock, so that this never waits for room in the
+   journal with the lock held. */
+static bool
+write_bits (block_sector_t sector, size_t cnt)
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+
+  return (free_map_file == NULL
+          || bitmap_write_part (free_map, free_map_file, sector, cnt));
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,6 +277,7 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_free ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -3,10 +3,12 @@
 #include <debug.h>
 #include <round.h>
 #include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/buffers.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* Number of sector indices stored directly in the inode. */
@@ -18,23 +20,147 @@
    sector. */
 #define NDINDIRECT_BYTES  (NINDIRECT_SECTORS * BLOCK_SECTOR_SIZE);
 
+/* Number of extents stored directly in the inode. */
+#define NROOT_EXTENTS     41
+/* Number of extents stored in an extent tree node. */
+#define NNODE_EXTENTS     42
+/* Maximum number of levels of nodes below the inode.  Two levels
+   map more than MAX_FILE_SIZE even if every extent is a single
+   sector. */
+#define EXTENT_MAX_DEPTH  2
+/* Maximum number of sectors allocated at once when a file with
+   extents grows. */
+#define EXTENT_RESERVE_MAX 64
+
+/* Number of bytes of data an inode with LAYOUT_INLINE holds in
+   place of its sector map. */
+#define INLINE_BYTES      ((NDIRECT_SECTORS + 1) * sizeof (block_sector_t))
+
+/* Number of runs of sectors each open inode remembers. */
+#define MAP_CACHE_SIZE    8
+
+/* Sizes of the preallocation windows of a growing file, in
+   sectors.  The first window is PREALLOC_MIN sectors and each
+   window after it is twice as long, up to PREALLOC_MAX. */
+#define PREALLOC_MIN      8
+#define PREALLOC_MAX      64
+
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e
+/* Identifies an extent tree node. */
+#define EXTENT_MAGIC 0x45585431
+
+/* On-disk inode layouts.  Inodes written before there was a
+   choice of layouts read as LAYOUT_BLOCKMAP.  Small files and
+   directories are created with LAYOUT_INLINE and change to the
+   file system's block layout once they grow past INLINE_BYTES. */
+enum inode_layout
+  {
+    LAYOUT_BLOCKMAP,                  /* Direct and doubly indirect. */
+    LAYOUT_EXTENT,                    /* Tree of extents. */
+    LAYOUT_INLINE                     /* Data in the inode itself. */
+  };
+
+/* Names of the block layouts, for the -fs-layout option. */
+static const char *layout_names[] = { "blockmap", "extent" };
+
+/* A run of CNT consecutive disk sectors starting at START that
+   hold the file's sectors starting at LOGICAL.  In an interior
+   node of an extent tree, START is instead the child node that
+   maps the file's sectors from LOGICAL up to the next entry's,
+   and CNT is 0. */
+struct extent
+{
+  uint32_t logical;                   /* First file sector mapped. */
+  block_sector_t start;               /* First disk sector or child. */
+  uint32_t cnt;                       /* Number of sectors. */
+};
+
+/* Root of an extent tree, stored in the inode.  In a tree of
+   depth 0 the root's entries are the extents themselves. */
+struct extent_root
+{
+  uint16_t cnt;                       /* Number of entries in use. */
+  uint16_t depth;                     /* Levels of nodes below the root. */
+  uint32_t sector_cnt;                /* File sectors mapped so far. */
+  struct extent extents[NROOT_EXTENTS];
+};
+
+/* Extent tree node.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_node
+{
+  uint16_t cnt;                       /* Number of entries in use. */
+  uint16_t depth;                     /* 0 for a leaf. */
+  uint32_t magic;                     /* EXTENT_MAGIC. */
+  struct extent extents[NNODE_EXTENTS];
+};
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
 {
-  block_sector_t start;               /* First data sector. */
+  uint32_t flags;                     /* INODE_* flags, see inode.h. */
   off_t length;                       /* File size in bytes. */
   unsigned short magic;               /* Magic number. */
-  unsigned short is_dir;              /* File or directory. */
-  /* The first NDIRECT_SECTORS data sector numbers are stored directly in
-     the inode. */
-  block_sector_t sectors[NDIRECT_SECTORS + 1];
+  uint8_t is_dir;                     /* File or directory. */
+  uint8_t layout;                     /* One of enum inode_layout. */
+  union
+    {
+      /* LAYOUT_BLOCKMAP: The first NDIRECT_SECTORS data sector numbers
+         are stored directly in the inode, followed by a doubly 
+         indirect sector. */
+      block_sector_t sectors[NDIRECT_SECTORS + 1];
+      /* LAYOUT_EXTENT. */
+      struct extent_root extents;
+      /* LAYOUT_INLINE: The data itself. */
+      uint8_t bytes[INLINE_BYTES];
+    };
+};
+
+/* A run of CNT consecutive file sectors starting at LOGICAL that
+   are held in consecutive disk sectors starting at START. */
+struct map_run
+{
+  size_t logical;                     /* First file sector. */
+  block_sector_t start;               /* First disk sector. */
+  size_t cnt;                         /* Number of sectors, 0 if unused. */
 };
 
 static off_t update_length (struct inode *inode, off_t offset);
+static bool holds_meta (struct inode *inode);
+static bool map_cache_lookup (struct inode *inode, size_t idx,
+                              block_sector_t *psector, size_t *pcnt);
+static void map_cache_insert (struct inode *inode, size_t idx,
+                              block_sector_t sector, size_t cnt);
+static struct buffer *acquire_map (block_sector_t sector);
+static size_t allocate_data (struct inode *inode, block_sector_t hint,
+                             size_t cnt, block_sector_t *sectorp);
+static bool blockmap_byte_to_sector (struct inode *inode, off_t pos,
+                                     block_sector_t *psector, size_t *pcnt);
+static size_t blockmap_run (const block_sector_t *sectors, size_t cnt);
+static void blockmap_free (struct inode *inode);
+static bool extent_byte_to_sector (struct inode *inode, off_t pos, off_t end,
+                                   block_sector_t *psector, size_t *pcnt);
+static bool extent_lookup (struct inode *inode, size_t idx,
+                           block_sector_t *psector, size_t *pcnt);
+static const struct extent *extent_search (const struct extent *extents,
+                                           size_t cnt, size_t idx);
+static bool extent_reserve (struct inode *inode, size_t sector_cnt);
+static bool extent_append (struct inode *inode, block_sector_t start,
+                           size_t cnt);
+static bool extent_add (struct extent *extents, uint16_t *cnt, size_t max,
+                        size_t logical, block_sector_t start,
+                        size_t sector_cnt);
+static void extent_add_mapped (struct inode *inode, size_t cnt);
+static bool extent_grow (struct inode *inode);
+static void extent_free (struct inode *inode);
+static void extent_free_node (block_sector_t sector);
+static bool inline_read (struct inode *inode, void *buffer, off_t size,
+                         off_t offset, off_t *pcnt);
+static bool inline_write (struct inode *inode, const void *buffer,
+                          off_t size, off_t offset);
+static bool inline_promote (struct inode *inode, bool is_dir);
 
 /* Returns the direct sector index of the byte offset. */
 static inline size_t
@@ -60,28 +186,194 @@ dindirect_sector_idx (off_t pos)
 /* In-memory inode. */
 struct inode 
 {
-  struct list_elem elem;              /* Element in inode list. */
+  struct list_elem elem;              /* Element in open inode bucket. */
   block_sector_t sector;              /* Sector number of disk location. */
   int open_cnt;                       /* Number of openers. */
+  bool loading;                       /* Being read in by its opener. */
+  struct condition loaded;            /* Signaled when LOADING clears. */
   bool removed;                       /* True if deleted, false otherwise. */
   int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
   struct lock lock;                   /* Used to protect directory inodes. */
+  enum inode_layout layout;           /* On-disk layout. */
   struct inode_disk *data;            /* Inode content. */
+  /* Copies of fields of the on-disk inode.  LENGTH and FLAGS are
+     only changed with the inode's sector acquired, along with the
+     sector itself. */
+  off_t length;                       /* File size in bytes. */
+  unsigned flags;                     /* INODE_* flags. */
+  bool is_dir;                        /* File or directory. */
+  /* Recently used mappings, protected by LOCK.  A file's sectors
+     never move once they're allocated, so these stay valid as
+     long as the inode is open. */
+  struct map_run map_cache[MAP_CACHE_SIZE];
+  size_t map_cache_hand;              /* Next mapping to replace. */
+  /* Preallocation window, protected by LOCK.  These sectors are 
+     allocated in the free map but not yet part of the file. */
+  block_sector_t prealloc_start;      /* First sector in the window. */
+  size_t prealloc_cnt;                /* Sectors left in the window. */
+  size_t prealloc_size;               /* Size of the next window. */
 };
 
+/* Block layout of inodes created from now on, or grown past 
+   INLINE_BYTES. */
+static enum inode_layout new_layout = LAYOUT_BLOCKMAP;
+
+/* Statistics. */
+static int lookups;             /* Calls to byte_to_sector(). */
+static int map_reads;           /* Buffers acquired to map sectors. */
+static int map_hits;            /* Lookups found in a map cache. */
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE. If there's no block device sector at offset POS
+   within INODE in *PSECTOR. If there's no block device sector at 
+   offset POS allocates one; the caller is about to access the bytes 
+   up to END, so the layout may allocate that far at once.  If PCNT 
+   is nonnull, stores the number of consecutive sectors, starting 
+   with *PSECTOR, that hold consecutive parts of the file in *PCNT, 
+   so the caller can move through them without looking each one up.
+   Returns false if a sector couldn't be allocated. */
+static bool
+byte_to_sector (struct inode *inode, bool is_dir, off_t pos, off_t end,
+                block_sector_t *psector, size_t *pcnt)
+{
+  ASSERT (inode != NULL);
+  ASSERT (pos < MAX_FILE_SIZE);
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+  size_t cnt = 1;
+  bool found;
+  bool success = true;
+
+  /* Directories are already locked.  Files must be locked to prevent races
+     when two or more processes are allocating and adding blocks at the same
+     time. */
+  if (!is_dir)
+    lock_acquire (&inode->lock);
+  lookups++;
+  found = map_cache_lookup (inode, idx, psector, &cnt);
+  if (found)
+    map_hits++;
+  if (!is_dir)
+    lock_release (&inode->lock);
+  if (!found)
+    {
+      /* Looking the sector up may allocate it, even for a read, so
+         it's a journal operation, which must begin before the file
+         is locked. */
+      journal_begin ();
+      if (!is_dir)
+        lock_acquire (&inode->lock);
+      if (inode->layout == LAYOUT_EXTENT)
+        success = extent_byte_to_sector (inode, pos, end, psector, &cnt);
+      else
+        success = blockmap_byte_to_sector (inode, pos, psector, &cnt);
+      if (success)
+        map_cache_insert (inode, idx, *psector, cnt);
+      if (!is_dir)
+        lock_release (&inode->lock);
+      journal_end ();
+    }
+  if (pcnt != NULL)
+    *pcnt = cnt;
+  return success;
+}
+
+/* Looks up file sector IDX in INODE's map cache.  If it's there,
+   stores its disk sector in *PSECTOR and the number of sectors 
+   left in the cached run, counting it, in *PCNT and returns true. */
+static bool
+map_cache_lookup (struct inode *inode, size_t idx, block_sector_t *psector,
+                  size_t *pcnt)
+{
+  struct map_run *run;
+
+  for (run = inode->map_cache; run < inode->map_cache + MAP_CACHE_SIZE;
+       run++)
+    if (idx - run->logical < run->cnt)
+      {
+        *psector = run->start + (idx - run->logical);
+        *pcnt = run->cnt - (idx - run->logical);
+        return true;
+      }
+  return false;
+}
+
+/* Adds the mapping of the CNT file sectors starting at IDX to the 
+   disk sectors starting at SECTOR to INODE's map cache.  If it 
+   continues a cached run, the run is extended, so a file read in 
+   order builds up runs as long as its contiguous pieces on disk.
+   Otherwise it replaces the cached runs in turn. */
+static void
+map_cache_insert (struct inode *inode, size_t idx, block_sector_t sector,
+                  size_t cnt)
+{
+  struct map_run *run;
+
+  for (run = inode->map_cache; run < inode->map_cache + MAP_CACHE_SIZE;
+       run++)
+    if (run->cnt > 0 && run->logical + run->cnt == idx
+        && run->start + run->cnt == sector)
+      {
+        run->cnt += cnt;
+        return;
+      }
+  run = &inode->map_cache[inode->map_cache_hand];
+  inode->map_cache_hand = (inode->map_cache_hand + 1) % MAP_CACHE_SIZE;
+  run->logical = idx;
+  run->start = sector;
+  run->cnt = cnt;
+}
+
+/* Acquires the buffer for SECTOR, which holds an inode or an
+   indirect or extent tree sector, to look up a mapping. */
+static struct buffer *
+acquire_map (block_sector_t sector)
+{
+  map_reads++;
+  return buffer_acquire (sector, true);
+}
+
+/* Allocates up to CNT consecutive sectors for INODE's data from 
+   its preallocation window, stores the first into *SECTORP, and 
+   returns the number allocated, which is 0 if the disk is full.  
+   An empty window is refilled with a run starting at HINT if
+   possible, so a growing file is laid out contiguously and the 
+   free map is changed once per window instead of once per 
+   sector. */
+static size_t
+allocate_data (struct inode *inode, block_sector_t hint, size_t cnt,
+               block_sector_t *sectorp)
+{
+  if (inode->prealloc_cnt == 0)
+    {
+      size_t size = cnt > inode->prealloc_size ? cnt : inode->prealloc_size;
+
+      inode->prealloc_cnt = free_map_allocate_near (hint, size,
+                                                    &inode->prealloc_start);
+      if (inode->prealloc_cnt == 0)
+        return 0;
+      if (inode->prealloc_size < PREALLOC_MAX)
+        inode->prealloc_size *= 2;
+    }
+  if (cnt > inode->prealloc_cnt)
+    cnt = inode->prealloc_cnt;
+  *sectorp = inode->prealloc_start;
+  inode->prealloc_start += cnt;
+  inode->prealloc_cnt -= cnt;
+  return cnt;
+}
+
+/* Stores the block device sector that contains byte offset POS
+   within INODE, which has LAYOUT_BLOCKMAP, in *PSECTOR and the number
+   of consecutive sectors, starting with it, that the same map sector
+   holds in *PCNT.  If there's no block device sector at offset POS 
    allocates one. NOTE: This function is written in such a way 
    as to never acquire more than one buffer at the same time 
    (calls to free_map_allocate acquire a buffer) to avoid a 
    potential dealock situation where a cache size number of processes 
    all acquire a buffer at the same time and attempt to acquire a second.*/
 static bool
-byte_to_sector (struct inode *inode, bool is_dir, off_t pos,
-                block_sector_t *psector)
+blockmap_byte_to_sector (struct inode *inode, off_t pos,
+                         block_sector_t *psector, size_t *pcnt)
 {
-  ASSERT (inode != NULL);
-  ASSERT (pos < MAX_FILE_SIZE);
   size_t sector_idx;
   block_sector_t sector;
   block_sector_t next_sector = 0;
@@ -91,34 +383,39 @@ byte_to_sector (struct inode *inode, bool is_dir, off_t pos,
   block_sector_t *data;
   bool success = false;
 
-  /* Directories are already locked.  Files must be locked to prevent races
-     when two or more processes are allocating and adding blocks at the same
-     time. */
-  if (!is_dir)
-    lock_acquire (&inode->lock);
+  *pcnt = 1;
   sector_idx = direct_sector_idx (pos);
   if (sector_idx >= NDIRECT_SECTORS)
     sector_idx = NDIRECT_SECTORS;
-  buffer = buffer_acquire (inode->sector, true);
+  buffer = acquire_map (inode->sector);
   inode->data = (struct inode_disk *) buffer->data;
   next_sector = inode->data->sectors[sector_idx];
   if (next_sector == 0)
     {
       buffer_release (buffer, false);
       /* Allocate and add a new indirect or data block. */
-      if (!free_map_allocate (1, &next_sector))
+      if (sector_idx < NDIRECT_SECTORS)
+        allocated = allocate_data (inode, inode->prealloc_start, 1,
+                                   &next_sector) > 0;
+      else
+        allocated = free_map_allocate (1, &next_sector);
+      if (!allocated)
         goto done;
-      allocated = true;
       buffer = buffer_acquire (inode->sector, true);
       inode->data = (struct inode_disk *) buffer->data;        
       inode->data->sectors[sector_idx] = next_sector;
       buffer_release (buffer, true);
-      buffer = buffer_acquire (next_sector, sector_idx >= NDIRECT_SECTORS);
+      buffer = buffer_acquire_new (next_sector,
+                                   sector_idx >= NDIRECT_SECTORS);
       data = (block_sector_t *) buffer->data;
-      memset (data, 0, BLOCK_SECTOR_SIZE);
     }
   else
-    buffer_release (buffer, false);
+    {
+      if (sector_idx < NDIRECT_SECTORS)
+        *pcnt = blockmap_run (inode->data->sectors + sector_idx,
+                              NDIRECT_SECTORS - sector_idx);
+      buffer_release (buffer, false);
+    }
   if (sector_idx < NDIRECT_SECTORS)
     {
       /* Data block. */
@@ -134,7 +431,7 @@ byte_to_sector (struct inode *inode, bool is_dir, off_t pos,
       /* Indirect block. */
       if (!allocated)
         {
-          buffer = buffer_acquire (sector, true);
+          buffer = acquire_map (sector);
           data = (block_sector_t *) buffer->data;
         }
       sector_idx = indirect_sector_idx (pos);
@@ -149,14 +446,13 @@ byte_to_sector (struct inode *inode, bool is_dir, off_t pos,
           data = (block_sector_t *) buffer->data;
           data[sector_idx] = next_sector;
           buffer_release (buffer, true);
-          buffer = buffer_acquire (next_sector, true);
+          buffer = buffer_acquire_new (next_sector, true);
           data = (block_sector_t *) buffer->data;
-          memset (data, 0, BLOCK_SECTOR_SIZE);
         }
       else
         {
           buffer_release (buffer, false);
-          buffer = buffer_acquire (next_sector, true);
+          buffer = acquire_map (next_sector);
           data = (block_sector_t *) buffer->data;
         }
       sector = next_sector;
@@ -165,40 +461,532 @@ byte_to_sector (struct inode *inode, bool is_dir, off_t pos,
       if (next_sector == 0)
         {
           buffer_release (buffer, false);
-          if (!free_map_allocate (1, &next_sector))
+          if (allocate_data (inode, inode->prealloc_start, 1,
+                             &next_sector) == 0)
             goto done;
           buffer = buffer_acquire (sector, true);
           data = (block_sector_t *) buffer->data;          
           data[sector_idx] = next_sector;
           buffer_release (buffer, true);
-          buffer = buffer_acquire (next_sector, false);
-          data = (block_sector_t *) buffer->data;
-          memset (data, 0, BLOCK_SECTOR_SIZE);
+          buffer = buffer_acquire_new (next_sector, false);
           buffer_release (buffer, true);
         }
       else
-        buffer_release (buffer, false);
+        {
+          *pcnt = blockmap_run (data + sector_idx,
+                                NINDIRECT_SECTORS - sector_idx);
+          buffer_release (buffer, false);
+        }
     }
   *psector = next_sector;
   success = true;
 
  done:
-  if (!is_dir)
-    lock_release (&inode->lock);
   return success;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
-static struct lock inodes_lock;
+/* Returns the number of the CNT entries in SECTORS, starting with
+   the first, that are consecutive disk sectors. */
+static size_t
+blockmap_run (const block_sector_t *sectors, size_t cnt)
+{
+  size_t run;
+
+  for (run = 1; run < cnt; run++)
+    if (sectors[run] != sectors[0] + run)
+      break;
+  return run;
+}
+
+
+/* Stores the block device sector that contains byte offset POS
+   within INODE, which has LAYOUT_EXTENT, in *PSECTOR and the 
+   number of sectors left in its extent in *PCNT.  If POS isn't 
+   mapped yet, maps the file's sectors up to the one that holds
+   END - 1, or EXTENT_RESERVE_MAX of them, whichever comes first,
+   so that they're allocated as one run. */
+static bool
+extent_byte_to_sector (struct inode *inode, off_t pos, off_t end,
+                       block_sector_t *psector, size_t *pcnt)
+{
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+  size_t sector_cnt;
+
+  if (extent_lookup (inode, idx, psector, pcnt))
+    return true;
+  if (end > MAX_FILE_SIZE)
+    end = MAX_FILE_SIZE;
+  sector_cnt = DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  if (sector_cnt > idx + EXTENT_RESERVE_MAX)
+    sector_cnt = idx + EXTENT_RESERVE_MAX;
+  if (sector_cnt <= idx)
+    sector_cnt = idx + 1;
+  return (extent_reserve (inode, sector_cnt)
+          && extent_lookup (inode, idx, psector, pcnt));
+}
+
+/* Looks up file sector IDX in INODE's extent tree.  If it's
+   mapped, stores its disk sector in *PSECTOR and the number of
+   sectors left in its extent, counting it, in *PCNT and returns
+   true.  Returns false if IDX is beyond the mapped sectors.  Only
+   one buffer is held at a time while walking down the tree. */
+static bool
+extent_lookup (struct inode *inode, size_t idx, block_sector_t *psector,
+               size_t *pcnt)
+{
+  struct buffer *buffer;
+  struct extent_node *node;
+  struct extent extent;
+  int depth;
+
+  buffer = acquire_map (inode->sector);
+  inode->data = (struct inode_disk *) buffer->data;
+  if (idx >= inode->data->extents.sector_cnt)
+    {
+      buffer_release (buffer, false);
+      return false;
+    }
+  depth = inode->data->extents.depth;
+  extent = *extent_search (inode->data->extents.extents,
+                           inode->data->extents.cnt, idx);
+  buffer_release (buffer, false);
+  for (; depth > 0; depth--)
+    {
+      buffer = acquire_map (extent.start);
+      node = (struct extent_node *) buffer->data;
+      ASSERT (node->magic == EXTENT_MAGIC);
+      extent = *extent_search (node->extents, node->cnt, idx);
+      buffer_release (buffer, false);
+    }
+  ASSERT (idx - extent.logical < extent.cnt);
+  *psector = extent.start + (idx - extent.logical);
+  *pcnt = extent.cnt - (idx - extent.logical);
+  return true;
+}
+
+/* Returns the last of the CNT entries in EXTENTS, which are sorted
+   by logical sector, that starts at or before file sector IDX. */
+static const struct extent *
+extent_search (const struct extent *extents, size_t cnt, size_t idx)
+{
+  size_t lo = 0;
+  size_t hi = cnt;
+
+  ASSERT (cnt > 0);
+  while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (extents[mid].logical <= idx)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  return &extents[lo];
+}
+
+/* Maps the first SECTOR_CNT sectors of INODE's file, allocating
+   and zeroing those that aren't mapped yet.  Allocation starts
+   right after the file's last sector if possible so the file
+   stays contiguous.  Returns true if successful. */
+static bool
+extent_reserve (struct inode *inode, size_t sector_cnt)
+{
+  struct buffer *buffer;
+  block_sector_t hint, start;
+  size_t mapped, cnt, i;
+
+  buffer = acquire_map (inode->sector);
+  inode->data = (struct inode_disk *) buffer->data;
+  mapped = inode->data->extents.sector_cnt;
+  buffer_release (buffer, false);
+  /* A new preallocation window should continue the file. */
+  hint = inode->prealloc_start;
+  if (inode->prealloc_cnt == 0 && mapped > 0
+      && extent_lookup (inode, mapped - 1, &hint, &cnt))
+    hint++;
+  while (mapped < sector_cnt)
+    {
+      cnt = allocate_data (inode, hint, sector_cnt - mapped, &start);
+      if (cnt == 0)
+        return false;
+      for (i = 0; i < cnt; i++)
+        buffer_release (buffer_acquire_new (start + i, false), true);
+      if (!extent_append (inode, start, cnt))
+        {
+          free_map_release (start, cnt);
+          return false;
+        }
+      mapped += cnt;
+      hint = start + cnt;
+    }
+  return true;
+}
+
+/* Maps the CNT disk sectors starting at START after the last
+   sector mapped in INODE's extent tree.  If they continue the
+   last extent it's extended, otherwise a new extent is added,
+   adding nodes to the tree as needed.  Returns true if
+   successful, false if a node couldn't be allocated. */
+static bool
+extent_append (struct inode *inode, block_sector_t start, size_t cnt)
+{
+  /* The rightmost node at each depth and whether it's full. */
+  block_sector_t path[EXTENT_MAX_DEPTH];
+  bool full[EXTENT_MAX_DEPTH];
+  /* New nodes at each depth. */
+  block_sector_t nodes[EXTENT_MAX_DEPTH];
+  struct extent_root *root;
+  struct extent_node *node;
+  struct buffer *buffer;
+  block_sector_t child;
+  size_t logical;
+  bool root_full;
+  int depth, d, i;
+
+  for (;;)
+    {
+      buffer = acquire_map (inode->sector);
+      inode->data = (struct inode_disk *) buffer->data;
+      root = &inode->data->extents;
+      logical = root->sector_cnt;
+      depth = root->depth;
+      if (depth == 0)
+        {
+          bool added = extent_add (root->extents, &root->cnt, NROOT_EXTENTS,
+                                   logical, start, cnt);
+          if (added)
+            root->sector_cnt += cnt;
+          buffer_release (buffer, added);
+          if (added)
+            return true;
+          if (!extent_grow (inode))
+            return false;
+          continue;
+        }
+      root_full = root->cnt == NROOT_EXTENTS;
+      child = root->extents[root->cnt - 1].start;
+      buffer_release (buffer, false);
+
+      /* Walk down the right edge of the tree and try the leaf. */
+      for (d = depth - 1; d >= 0; d--)
+        {
+          buffer = acquire_map (child);
+          node = (struct extent_node *) buffer->data;
+          ASSERT (node->magic == EXTENT_MAGIC);
+          if (d == 0 && extent_add (node->extents, &node->cnt, NNODE_EXTENTS,
+                                    logical, start, cnt))
+            {
+              buffer_release (buffer, true);
+              extent_add_mapped (inode, cnt);
+              return true;
+            }
+          path[d] = child;
+          full[d] = node->cnt == NNODE_EXTENTS;
+          child = node->extents[node->cnt - 1].start;
+          buffer_release (buffer, false);
+        }
+
+      /* The leaf is full.  Find the lowest node on the right edge
+         with room for another entry, adding a level if there's
+         none, and hang a new chain of nodes ending in a leaf 
+         with the new extent from it. */
+      for (d = 1; d < depth && full[d]; d++)
+        continue;
+      if (d == depth && root_full)
+        {
+          if (!extent_grow (inode))
+            return false;
+          continue;
+        }
+      for (i = 0; i < d; i++)
+        if (!free_map_allocate (1, &nodes[i]))
+          {
+            while (i-- > 0)
+              free_map_release (nodes[i], 1);
+            return false;
+          }
+      for (i = 0; i < d; i++)
+        {
+          buffer = buffer_acquire_new (nodes[i], true);
+          node = (struct extent_node *) buffer->data;
+          node->magic = EXTENT_MAGIC;
+          node->depth = i;
+          if (i == 0)
+            extent_add (node->extents, &node->cnt, NNODE_EXTENTS, logical,
+                        start, cnt);
+          else
+            extent_add (node->extents, &node->cnt, NNODE_EXTENTS, logical,
+                        nodes[i - 1], 0);
+          buffer_release (buffer, true);
+        }
+      if (d == depth)
+        {
+          buffer = buffer_acquire (inode->sector, true);
+          inode->data = (struct inode_disk *) buffer->data;
+          root = &inode->data->extents;
+          extent_add (root->extents, &root->cnt, NROOT_EXTENTS, logical,
+                      nodes[d - 1], 0);
+          root->sector_cnt += cnt;
+          buffer_release (buffer, true);
+        }
+      else
+        {
+          buffer = buffer_acquire (path[d], true);
+          node = (struct extent_node *) buffer->data;
+          extent_add (node->extents, &node->cnt, NNODE_EXTENTS, logical,
+                      nodes[d - 1], 0);
+          buffer_release (buffer, true);
+          extent_add_mapped (inode, cnt);
+        }
+      return true;
+    }
+}
+
+/* Adds an entry that maps SECTOR_CNT file sectors starting at
+   LOGICAL to START to the end of EXTENTS, which holds *CNT of at
+   most MAX entries.  An extent that continues the last one is
+   merged into it; interior entries have a SECTOR_CNT of 0 and are
+   never merged.  Returns false if EXTENTS is full. */
+static bool
+extent_add (struct extent *extents, uint16_t *cnt, size_t max,
+            size_t logical, block_sector_t start, size_t sector_cnt)
+{
+  if (*cnt > 0 && sector_cnt > 0)
+    {
+      struct extent *last = &extents[*cnt - 1];
+      if (last->cnt > 0 && last->start + last->cnt == start)
+        {
+          last->cnt += sector_cnt;
+          return true;
+        }
+    }
+  if (*cnt == max)
+    return false;
+  extents[*cnt].logical = logical;
+  extents[*cnt].start = start;
+  extents[*cnt].cnt = sector_cnt;
+  (*cnt)++;
+  return true;
+}
+
+/* Adds CNT to the number of sectors mapped by INODE's extent
+   tree. */
+static void
+extent_add_mapped (struct inode *inode, size_t cnt)
+{
+  struct buffer *buffer;
+
+  buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) buffer->data;
+  inode->data->extents.sector_cnt += cnt;
+  buffer_release (buffer, true);
+}
+
+/* Adds a level to INODE's extent tree by moving the root's
+   entries into a new node that becomes the root's only child.
+   Returns true if successful. */
+static bool
+extent_grow (struct inode *inode)
+{
+  struct extent_root *root;
+  struct extent_node *node;
+  struct buffer *buffer;
+  block_sector_t sector;
+
+  node = malloc (sizeof *node);
+  if (node == NULL)
+    return false;
+  if (!free_map_allocate (1, &sector))
+    {
+      free (node);
+      return false;
+    }
+  buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) buffer->data;
+  root = &inode->data->extents;
+  ASSERT (root->depth < EXTENT_MAX_DEPTH);
+  node->cnt = root->cnt;
+  node->depth = root->depth;
+  node->magic = EXTENT_MAGIC;
+  memcpy (node->extents, root->extents, sizeof root->extents);
+  root->cnt = 1;
+  root->depth++;
+  root->extents[0].logical = 0;
+  root->extents[0].start = sector;
+  root->extents[0].cnt = 0;
+  buffer_release (buffer, true);
+  buffer = buffer_acquire_new (sector, true);
+  memcpy (buffer->data, node, sizeof *node);
+  buffer_release (buffer, true);
+  free (node);
+  return true;
+}
+
+/* Frees the sectors mapped by INODE's extent tree along with the
+   tree's nodes. */
+static void
+extent_free (struct inode *inode)
+{
+  struct buffer *buffer;
+  struct extent extent;
+  bool done;
+  size_t i;
+  int depth;
+
+  for (i = 0; ; i++)
+    {
+      buffer = buffer_acquire (inode->sector, true);
+      inode->data = (struct inode_disk *) buffer->data;
+      depth = inode->data->extents.depth;
+      done = i >= inode->data->extents.cnt;
+      if (!done)
+        extent = inode->data->extents.extents[i];
+      buffer_release (buffer, false);
+      if (done)
+        break;
+      if (depth == 0)
+        free_map_release (extent.start, extent.cnt);
+      else
+        extent_free_node (extent.start);
+    }
+}
+
+/* Frees extent tree node SECTOR, its descendants, and the sectors
+   they map. */
+static void
+extent_free_node (block_sector_t sector)
+{
+  struct extent_node *node;
+  struct buffer *buffer;
+  struct extent extent;
+  bool done;
+  size_t i;
+  int depth;
+
+  for (i = 0; ; i++)
+    {
+      buffer = buffer_acquire (sector, true);
+      node = (struct extent_node *) buffer->data;
+      ASSERT (node->magic == EXTENT_MAGIC);
+      depth = node->depth;
+      done = i >= node->cnt;
+      if (!done)
+        extent = node->extents[i];
+      buffer_release (buffer, false);
+      if (done)
+        break;
+      if (depth == 0)
+        free_map_release (extent.start, extent.cnt);
+      else
+        extent_free_node (extent.start);
+    }
+  free_map_release (sector, 1);
+}
+
+/* Open inodes, hashed by sector into buckets, so that opening a
+   single inode twice returns the same `struct inode'.  Each
+   bucket's lock protects its list and the open counts of the
+   inodes in it. */
+#define INODE_BUCKETS 64
+
+struct inode_bucket
+  {
+    struct list inodes;                 /* List of open inodes. */
+    struct lock lock;                   /* Protects INODES. */
+  };
+
+static struct inode_bucket open_inodes[INODE_BUCKETS];
+
+/* Returns the bucket of open inodes for SECTOR. */
+static struct inode_bucket *
+inode_bucket (block_sector_t sector)
+{
+  return &open_inodes[sector % INODE_BUCKETS];
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
-  lock_init (&inodes_lock);
+  size_t i;
+
+  for (i = 0; i < INODE_BUCKETS; i++)
+    {
+      list_init (&open_inodes[i].inodes);
+      lock_init (&open_inodes[i].lock);
+    }
+}
+
+/* Gives back the preallocation windows of all open inodes, so 
+   the free map written out at shutdown doesn't lose their 
+   sectors. */
+void
+inode_done (void)
+{
+  struct inode_bucket *bucket;
+  struct list_elem *e;
+  struct inode *inode;
+
+  /* Begun before any bucket is locked, see filesys/journal.c. */
+  journal_begin ();
+  for (bucket = open_inodes; bucket < open_inodes + INODE_BUCKETS; bucket++)
+    {
+      lock_acquire (&bucket->lock);
+      for (e = list_begin (&bucket->inodes); e != list_end (&bucket->inodes);
+           e = list_next (e))
+        {
+          inode = list_entry (e, struct inode, elem);
+          if (inode->prealloc_cnt > 0)
+            {
+              free_map_release (inode->prealloc_start, inode->prealloc_cnt);
+              inode->prealloc_cnt = 0;
+            }
+        }
+      lock_release (&bucket->lock);
+    }
+  journal_end ();
+}
+
+/* Makes inodes created from now on use the layout called NAME. 
+   Returns false if there's no such layout. */
+bool
+inode_set_layout (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof layout_names / sizeof *layout_names; i++)
+    if (!strcmp (name, layout_names[i]))
+      {
+        new_layout = i;
+        return true;
+      }
+  return false;
+}
+
+/* Makes inodes created from now on use the same layout as the
+   inode in SECTOR, so a file system keeps the layout it was
+   formatted with. */
+void
+inode_inherit_layout (block_sector_t sector)
+{
+  struct buffer *buffer;
+
+  enum inode_layout layout;
+
+  buffer = buffer_acquire (sector, true);
+  layout = ((struct inode_disk *) buffer->data)->layout;
+  buffer_release (buffer, false);
+  if (layout != LAYOUT_INLINE)
+    new_layout = layout;
+}
+
+/* Prints inode statistics. */
+void
+inode_print_stats (void)
+{
+  printf ("inode layout %s: %d lookups, %d map cache hits, "
+          "%d map sectors read\n", layout_names[new_layout], lookups,
+          map_hits, map_reads);
 }
 
 /* Initializes an inode for a file or directory with LENGTH length 
@@ -217,6 +1005,7 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_node) == BLOCK_SECTOR_SIZE);
 
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
@@ -224,6 +1013,8 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->is_dir = is_dir;
+      disk_inode->layout = (length <= (off_t) INLINE_BYTES ? LAYOUT_INLINE
+                            : new_layout);
       buffer = buffer_acquire (sector, true);
       memcpy (buffer->data, disk_inode, sizeof *disk_inode);
       buffer_release (buffer, true);
@@ -235,41 +1026,70 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
-   Returns a null pointer if memory allocation fails. */
+   Returns a null pointer if memory allocation fails.  The bucket
+   lock isn't held while the inode is read from disk: the inode is
+   marked as loading instead, and anyone else opening it meanwhile
+   waits for the read. */
 struct inode *
 inode_open (block_sector_t sector)
 {
+  struct inode_bucket *bucket = inode_bucket (sector);
   struct list_elem *e;
   struct inode *inode = NULL;
+  struct buffer *buffer;
 
-  lock_acquire (&inodes_lock);
+  lock_acquire (&bucket->lock);
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+  for (e = list_begin (&bucket->inodes); e != list_end (&bucket->inodes);
        e = list_next (e)) 
     {
       inode = list_entry (e, struct inode, elem);
       if (inode->sector == sector) 
         {
           inode->open_cnt++;
-          goto done;
+          while (inode->loading)
+            cond_wait (&inode->loaded, &bucket->lock);
+          lock_release (&bucket->lock);
+          return inode;
         }
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    goto done;
+    {
+      lock_release (&bucket->lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  list_push_front (&bucket->inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  cond_init (&inode->loaded);
   inode->deny_write_cnt = 0;
   inode->removed = false;
   lock_init (&inode->lock);
+  memset (inode->map_cache, 0, sizeof inode->map_cache);
+  inode->map_cache_hand = 0;
+  inode->prealloc_start = sector + 1;
+  inode->prealloc_cnt = 0;
+  inode->prealloc_size = PREALLOC_MIN;
+  lock_release (&bucket->lock);
 
- done:
-  lock_release (&inodes_lock);
+  buffer = buffer_acquire (sector, true);
+  inode->data = (struct inode_disk *) buffer->data;
+  inode->layout = inode->data->layout;
+  inode->length = inode->data->length;
+  inode->flags = inode->data->flags;
+  inode->is_dir = inode->data->is_dir;
+  buffer_release (buffer, false);
+
+  lock_acquire (&bucket->lock);
+  inode->loading = false;
+  cond_broadcast (&inode->loaded, &bucket->lock);
+  lock_release (&bucket->lock);
   return inode;
 }
 
@@ -277,10 +1097,15 @@ inode_open (block_sector_t sector)
 struct inode *
 inode_reopen (struct inode *inode)
 {
-  lock_acquire (&inodes_lock);
+  struct inode_bucket *bucket;
+
   if (inode != NULL)
-    inode->open_cnt++;
-  lock_release (&inodes_lock);
+    {
+      bucket = inode_bucket (inode->sector);
+      lock_acquire (&bucket->lock);
+      inode->open_cnt++;
+      lock_release (&bucket->lock);
+    }
   return inode;
 }
 
@@ -301,6 +1126,46 @@ inode_get_inumber (const struct inode *inode)
    to acquire a second.*/
 void
 inode_close (struct inode *inode) 
+{
+  struct inode_bucket *bucket;
+
+  /* Ignore null pointer. */
+  if (inode == NULL)
+    return;
+  bucket = inode_bucket (inode->sector);
+  lock_acquire (&bucket->lock);
+  /* Release resources if this was the last opener. */
+  if (--inode->open_cnt == 0)
+    {
+      /* Remove from inode list and release lock. */
+      list_remove (&inode->elem);
+      lock_release (&bucket->lock);
+ 
+      /* Give back what's left of the preallocation window. */
+      journal_begin ();
+      if (inode->prealloc_cnt > 0)
+        free_map_release (inode->prealloc_start, inode->prealloc_cnt);
+
+      /* Deallocate blocks if removed. */
+      if (inode->removed) 
+        {
+          if (inode->layout == LAYOUT_EXTENT)
+            extent_free (inode);
+          else if (inode->layout == LAYOUT_BLOCKMAP)
+            blockmap_free (inode);
+          free_map_release (inode->sector, 1);
+        }
+      journal_end ();
+      free (inode); 
+    }
+  else
+    lock_release (&bucket->lock);
+}
+
+/* Frees the data, indirect, and doubly indirect sectors of INODE,
+   which has LAYOUT_BLOCKMAP. */
+static void
+blockmap_free (struct inode *inode)
 {
   /* A data sector. */
   block_sector_t sector;
@@ -313,63 +1178,43 @@ inode_close (struct inode *inode)
   block_sector_t *data;
   size_t i;
   size_t j;
-  
-  /* Ignore null pointer. */
-  if (inode == NULL)
-    return;
-  lock_acquire (&inodes_lock);
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+
+  /* Free direct data blocks. */
+  buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) buffer->data;
+  for (i = 0; i < NDIRECT_SECTORS; i++)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
-      lock_release (&inodes_lock);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
+      sector = inode->data->sectors[i];
+      if (sector != 0)
+        free_map_release (sector, 1);
+    }
+  isector = inode->data->sectors[NDIRECT_SECTORS];
+  buffer_release (buffer, false);
+  /* Free indirect, doubly indirect, and data blocks. */
+  if (isector != 0)
+    {
+      for (i = 0; i < NINDIRECT_SECTORS; i++)
         {
-          /* Free direct data blocks and disk inode. */
-          buffer = buffer_acquire (inode->sector, true);
-          inode->data = (struct inode_disk *) buffer->data;
-          for (i = 0; i < NDIRECT_SECTORS; i++)
-            {
-              sector = inode->data->sectors[i];
-              if (sector != 0)
-                free_map_release (sector, 1);
-            }
-          isector = inode->data->sectors[NDIRECT_SECTORS];
+          buffer = buffer_acquire (isector, true);
+          data = (block_sector_t *) buffer->data;
+          disector = data[i];
           buffer_release (buffer, false);
-          free_map_release (inode->sector, 1);
-          /* Free indirect, doubly indirect, and data blocks. */
-          if (isector != 0)
+          if (disector != 0)
             {
-              for (i = 0; i < NINDIRECT_SECTORS; i++)
+              for (j = 0; j < NINDIRECT_SECTORS; j++)
                 {
-                  buffer = buffer_acquire (isector, true);
+                  buffer = buffer_acquire (disector, true);
                   data = (block_sector_t *) buffer->data;
-                  disector = data[i];
+                  sector = data[j];
                   buffer_release (buffer, false);
-                  if (disector != 0)
-                    {
-                      for (j = 0; j < NINDIRECT_SECTORS; j++)
-                        {
-                          buffer = buffer_acquire (disector, true);
-                          data = (block_sector_t *) buffer->data;
-                          sector = data[j];
-                          buffer_release (buffer, false);
-                          if (sector != 0)
-                            free_map_release (sector, 1);
-                        }
-                      free_map_release (disector, 1);
-                    }
+                  if (sector != 0)
+                    free_map_release (sector, 1);
                 }
-              free_map_release (isector, 1);
+              free_map_release (disector, 1);
             }
         }
-      free (inode); 
+      free_map_release (isector, 1);
     }
-  else
-    lock_release (&inodes_lock);
 }
 
 void
@@ -404,19 +1249,28 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
   off_t length;
-  bool is_dir;
-  off_t new_offset;
+  off_t end;
+  bool is_dir, meta;
   block_sector_t sector;
+  size_t run = 0;
 
   if (size <= 0)
     return 0;
+  if (inode->layout == LAYOUT_INLINE
+      && inline_read (inode, buffer, size, offset, &bytes_read))
+    return bytes_read;
   length = inode_length (inode);
   is_dir = inode_is_dir (inode);
   if (offset >= length)
     return 0;
+  end = offset + size < length ? offset + size : length;
+  meta = holds_meta (inode);
   while (size > 0) 
     {
-      if (!byte_to_sector (inode, is_dir, offset, &sector))
+      /* Only look up the sector if it's not the next one in the run of
+         consecutive sectors found by the last lookup. */
+      if (run == 0
+          && !byte_to_sector (inode, is_dir, offset, end, &sector, &run))
         break;
       
       /* Disk sector to read, starting byte offset within sector. */
@@ -432,7 +1286,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      cached_buffer = buffer_acquire (sector, false);
+      cached_buffer = buffer_acquire (sector, meta);
       memcpy (buffer + bytes_read, cached_buffer->data + sector_ofs,
               chunk_size);          
       buffer_release (cached_buffer, false);
@@ -441,16 +1295,39 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
+      sector++;
+      run--;
     }
-  /* If possible, read ahead the next sector so it's cached for a sequential
-     read. */
-  new_offset = offset + BLOCK_SECTOR_SIZE - 1;
-  if (size == 0 && new_offset > offset && new_offset < length
-      && byte_to_sector (inode, is_dir, new_offset, &sector))
-    buffer_read_ahead (sector, false);
   return bytes_read;
 }
 
+/* Queues the sectors of INODE that hold the SIZE bytes starting at OFFSET,
+   up to the end of the file, to be read ahead.  Each run of consecutive 
+   sectors is found with a single lookup and queued as one range. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t length = inode_length (inode);
+  bool is_dir = inode_is_dir (inode);
+  block_sector_t sector;
+  size_t cnt, left;
+  off_t end;
+
+  if (inode->layout == LAYOUT_INLINE)
+    return;
+  end = offset + size < length ? offset + size : length;
+  for (offset = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE); offset < end;
+       offset += cnt * BLOCK_SECTOR_SIZE)
+    {
+      if (!byte_to_sector (inode, is_dir, offset, end, &sector, &cnt))
+        break;
+      left = DIV_ROUND_UP (end - offset, BLOCK_SECTOR_SIZE);
+      if (cnt > left)
+        cnt = left;
+      buffer_read_ahead (sector, cnt, false);
+    }
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs. */
@@ -462,16 +1339,41 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
   off_t length;
-  bool is_dir;
+  bool is_dir, meta;
   off_t new_offset;
+  off_t end;
   block_sector_t sector;
+  size_t run = 0;
 
   if (inode->deny_write_cnt || size <= 0)
     return 0;
+  journal_begin ();
   is_dir = inode_is_dir (inode);
+  if (inode->layout == LAYOUT_INLINE)
+    {
+      if (inline_write (inode, buffer, size, offset))
+        {
+          journal_end ();
+          return size;
+        }
+      if (!inline_promote (inode, is_dir))
+        {
+          journal_end ();
+          return 0;
+        }
+    }
+  meta = holds_meta (inode);
+  end = offset + size;
   while (size > 0) 
     {
-      if (!byte_to_sector (inode, is_dir, offset, &sector))
+      /* Each run of a file's data is a step of its own in the
+         journal, so that a long write never needs more room in the
+         log than one step.  Directories and the free map are written
+         as parts of bigger operations. */
+      if (run == 0 && !meta && bytes_written > 0)
+        journal_restart ();
+      if (run == 0
+          && !byte_to_sector (inode, is_dir, offset, end, &sector, &run))
         break;
 
       /* Disk sector to read, starting byte offset within sector. */
@@ -487,7 +1389,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
       
-      cached_buffer = buffer_acquire (sector, false);
+      cached_buffer = buffer_acquire (sector, meta);
       memcpy (cached_buffer->data + sector_ofs, buffer + bytes_written,
               chunk_size);
       buffer_release (cached_buffer, true);
@@ -496,6 +1398,8 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
+      sector++;
+      run--;
     }
   /* If the file was extended, update the length. */
   length = update_length (inode, offset);
@@ -503,11 +1407,136 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
      write. */
   new_offset = offset + BLOCK_SECTOR_SIZE - 1;
   if (size == 0 && new_offset > offset && new_offset < length
-      && byte_to_sector (inode, is_dir, new_offset, &sector))
-    buffer_read_ahead (sector, false);
+      && byte_to_sector (inode, is_dir, new_offset, new_offset + 1, &sector,
+                         NULL))
+    buffer_read_ahead (sector, 1, meta);
+  journal_end ();
   return bytes_written;
 }
 
+/* If INODE has LAYOUT_INLINE, copies up to SIZE bytes of its data
+   starting at OFFSET into BUFFER, stores the number of bytes copied 
+   in *PCNT, and returns true.  Returns false if INODE's data is in 
+   sectors of its own, which it may have moved to since the caller 
+   looked at its layout. */
+static bool
+inline_read (struct inode *inode, void *buffer, off_t size, off_t offset,
+             off_t *pcnt)
+{
+  struct buffer *cached_buffer;
+  off_t length;
+  bool success = false;
+
+  cached_buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) cached_buffer->data;
+  if (inode->data->layout == LAYOUT_INLINE)
+    {
+      length = inode->data->length;
+      *pcnt = offset < length ? (size < length - offset ? size 
+                                 : length - offset) : 0;
+      memcpy (buffer, inode->data->bytes + offset, *pcnt);
+      success = true;
+    }
+  buffer_release (cached_buffer, false);
+  return success;
+}
+
+/* If INODE has LAYOUT_INLINE and the SIZE bytes starting at OFFSET
+   fit in the inode, writes them from BUFFER, extending INODE if 
+   necessary, and returns true.  Otherwise returns false. */
+static bool
+inline_write (struct inode *inode, const void *buffer, off_t size,
+              off_t offset)
+{
+  struct buffer *cached_buffer;
+  bool success = false;
+
+  if (offset + size > (off_t) INLINE_BYTES)
+    return false;
+  cached_buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) cached_buffer->data;
+  if (inode->data->layout == LAYOUT_INLINE)
+    {
+      memcpy (inode->data->bytes + offset, buffer, size);
+      if (offset + size > inode->data->length)
+        {
+          inode->data->length = offset + size;
+          inode->length = offset + size;
+        }
+      success = true;
+    }
+  buffer_release (cached_buffer, success);
+  return success;
+}
+
+/* Moves INODE's data out of the inode into a sector of its own, 
+   changing it from LAYOUT_INLINE to the block layout, so that it 
+   can grow past INLINE_BYTES.  Does nothing if INODE has a block
+   layout already.  Directories are already locked.  Files are 
+   locked here, so that a reader who finds the block layout waits in
+   byte_to_sector() until the data has been copied.  Returns false
+   if memory or disk allocation fails, leaving INODE as it was. */
+static bool
+inline_promote (struct inode *inode, bool is_dir)
+{
+  struct buffer *buffer;
+  uint8_t *data;
+  off_t length;
+  block_sector_t sector;
+  size_t cnt;
+  bool success = true;
+
+  data = malloc (INLINE_BYTES);
+  if (data == NULL)
+    return false;
+  if (!is_dir)
+    lock_acquire (&inode->lock);
+  buffer = buffer_acquire (inode->sector, true);
+  inode->data = (struct inode_disk *) buffer->data;
+  if (inode->data->layout != LAYOUT_INLINE)
+    {
+      buffer_release (buffer, false);
+      goto done;
+    }
+  length = inode->data->length;
+  memcpy (data, inode->data->bytes, INLINE_BYTES);
+  memset (inode->data->bytes, 0, INLINE_BYTES);
+  inode->data->layout = new_layout;
+  inode->layout = new_layout;
+  buffer_release (buffer, true);
+
+  /* An empty map needs no sectors until something is written. */
+  if (length == 0)
+    goto done;
+  if (new_layout == LAYOUT_EXTENT)
+    success = extent_byte_to_sector (inode, 0, length, &sector, &cnt);
+  else
+    success = blockmap_byte_to_sector (inode, 0, &sector, &cnt);
+  if (success)
+    {
+      map_cache_insert (inode, 0, sector, cnt);
+      buffer = buffer_acquire (sector, holds_meta (inode));
+      memcpy (buffer->data, data, length);
+      buffer_release (buffer, true);
+    }
+  else
+    {
+      /* Nothing was allocated, so the map is still empty. */
+      buffer = buffer_acquire (inode->sector, true);
+      inode->data = (struct inode_disk *) buffer->data;
+      memcpy (inode->data->bytes, data, INLINE_BYTES);
+      inode->data->layout = LAYOUT_INLINE;
+      inode->layout = LAYOUT_INLINE;
+      buffer_release (buffer, true);
+    }
+
+ done:
+  if (!is_dir)
+    lock_release (&inode->lock);
+  free (data);
+  return success;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -532,28 +1561,50 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (struct inode *inode)
 {
-  struct buffer *buffer;
-  off_t length;
-  
-  buffer = buffer_acquire (inode->sector, true);
-  inode->data = (struct inode_disk *) buffer->data;
-  length = inode->data->length;
-  buffer_release (buffer, false);
-  return length;
+  return inode->length;
 }
 
 /* Returns true if the inode is a directory, false if it's a file. */
 bool
 inode_is_dir (struct inode *inode)
+{
+  return inode->is_dir;
+}
+
+/* Returns INODE's flags. */
+unsigned
+inode_get_flags (struct inode *inode)
+{
+  return inode->flags;
+}
+
+/* Sets FLAGS in INODE, leaving its other flags alone. */
+void
+inode_set_flags (struct inode *inode, unsigned flags)
+{
+  inode_replace_flags (inode, flags, flags);
+}
+
+/* Replaces the flags in MASK in INODE by those in FLAGS, leaving
+   its other flags alone. */
+void
+inode_replace_flags (struct inode *inode, unsigned mask, unsigned flags)
 {
   struct buffer *buffer;
-  bool is_dir;
   
   buffer = buffer_acquire (inode->sector, true);
   inode->data = (struct inode_disk *) buffer->data;
-  is_dir = inode->data->is_dir;
-  buffer_release (buffer, false);
-  return is_dir;
+  inode->data->flags = (inode->data->flags & ~mask) | (flags & mask);
+  inode->flags = inode->data->flags;
+  buffer_release (buffer, true);
+}
+
+/* Returns true if INODE's data is meta data, which goes through the
+   journal: a directory's entries or the free map. */
+static bool
+holds_meta (struct inode *inode)
+{
+  return inode->is_dir || inode->sector == FREE_MAP_SECTOR;
 }
 
 /* Returns true if the inode has been removed, false if not. */
@@ -576,6 +1627,7 @@ update_length (struct inode *inode, off_t offset)
     {
       length = offset;
       inode->data->length = length;
+      inode->length = length;
       buffer_release (buffer, true);
     }
   else
@@ -9,9 +9,18 @@
    8 megabytes. */
 #define MAX_FILE_SIZE             (8 * 1024 * 1024)
 
+/* Inode flags, for use by the layers above. */
+#define INODE_HASHED_DIR          0x1   /* Directory entries are hashed. */
+#define INODE_DIR_CNT_SHIFT       8     /* Bits from here up: number of
+                                           entries in a hashed directory. */
+
 struct bitmap;
 
 void inode_init (void);
+void inode_done (void);
+bool inode_set_layout (const char *name);
+void inode_inherit_layout (block_sector_t);
+void inode_print_stats (void);
 bool inode_create (block_sector_t, off_t, bool is_dir);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
@@ -21,11 +30,15 @@ void inode_lock (struct inode *);
 void inode_unlock (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead (struct inode *, off_t offset, off_t size);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (struct inode *);
 bool inode_is_dir (struct inode *);
+unsigned inode_get_flags (struct inode *);
+void inode_set_flags (struct inode *, unsigned);
+void inode_replace_flags (struct inode *, unsigned mask, unsigned flags);
 bool inode_is_removed (struct inode *);
 
 #endif /* filesys/inode.h */
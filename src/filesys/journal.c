@@ -0,0 +1,590 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Implements a write ahead journal for meta data: inodes, extent and
+   indirect sectors, directories, and the free map.
+
+   Meta data buffers are never written in place by the buffer cache.
+   Instead, when a changed meta data buffer is released, a copy of it
+   goes into the running transaction and the buffer is treated as
+   clean.  The write back thread commits the running transaction
+   every time it wakes up, so that all the changes made in the
+   meantime are written together: the copies go to the log with one
+   request, then the log header is written naming the sectors the
+   copies belong in, which is the commit point, then the copies are
+   written in place and the header is cleared.  After a crash,
+   journal_recover() finds a header that wasn't cleared and writes
+   the copies in place again.
+
+   File system operations are bracketed by journal_begin() and
+   journal_end() and belong to the transaction that was running when
+   they began, so a transaction only holds whole operations.  A
+   commit makes a new transaction the running one and then waits for
+   the operations in the old one to end, so operations in progress
+   never wait for a commit.
+
+   A transaction has to fit in the log, so each operation in progress
+   holds room in it for OP_SECTORS sectors on top of the sectors
+   already logged, and journal_begin() commits the running
+   transaction itself, waiting for its operations to end, when
+   there's not enough room left for another.  An operation that can
+   change more sectors than that, like a long write or a directory
+   that has to grow first, is made of steps that each leave the file
+   system consistent, with journal_restart() between them.  Waiting
+   for room must not hold up an operation in progress, so
+   journal_begin() and journal_restart() are never called with a
+   lock held that an operation may wait for: directories are locked
+   before an operation that changes them begins, and the inode and
+   free map locks only while one is in progress.
+
+   Until a transaction is written in place, the latest contents of its
+   sectors are only in memory, so journal_read() supplies them when
+   they miss in the cache, and sectors that a transaction holds aren't
+   returned to the free map until it's written, so they can't be
+   reused and then overwritten with the old copies.  The commit
+   returns them in an operation of its own in the next transaction,
+   which it joins before any other, so it has room and the next
+   transaction can't be committed before they're returned. */
+
+/* Identifies the log header. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* Number of copies that fit in the log after the header. */
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Most sectors a single operation, or step of one, may change. */
+#define OP_SECTORS 16
+
+/* Number of copies there can be at once: a full transaction being
+   committed, and a full running one. */
+#define POOL_BLOCKS (2 * LOG_SECTORS)
+
+/* Most releases a transaction can hold back.  Each covers a sector
+   held by the transaction or by the one committed before it, which
+   stays allocated until the release is done, so no two share one,
+   and those two transactions hold no more than POOL_BLOCKS. */
+#define MAX_RELEASES POOL_BLOCKS
+
+/* The log header, in sector JOURNAL_SECTOR. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Number of the last commit. */
+    uint32_t cnt;                       /* Copies in the log, 0 if none. */
+    block_sector_t home[LOG_SECTORS];   /* Where each copy belongs. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 12 - LOG_SECTORS * 4];
+  };
+
+/* Sectors released to the free map while a transaction held them. */
+struct journal_release
+  {
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+/* A transaction. */
+struct transaction
+  {
+    struct hash blocks;                 /* Copies of changed sectors. */
+    struct journal_release releases[MAX_RELEASES];
+                                        /* Sectors to release once written. */
+    size_t release_cnt;                 /* Number of RELEASES in use. */
+    int active;                         /* Operations still in progress. */
+  };
+
+/* A copy of a changed meta data sector. */
+struct journal_block
+  {
+    struct hash_elem elem;              /* Element in transaction's blocks. */
+    struct list_elem free_elem;         /* Element in free_blocks. */
+    block_sector_t sector;              /* Sector it belongs in. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+/* True if the file system has a journal. */
+static bool enabled;
+/* Protects the transactions. */
+static struct lock journal_lock;
+/* Serializes commits. */
+static struct lock commit_lock;
+/* Signaled when the last operation in CLOSING ends. */
+static struct condition closing_done;
+/* The two transactions, which take turns running. */
+static struct transaction transactions[2];
+/* The transaction new operations join. */
+static struct transaction *running;
+/* The transaction being committed, or NULL. */
+static struct transaction *closing;
+/* Copies not in use, POOL_BLOCKS of them in all.  They are allocated
+   up front so that logging a sector never fails, and so meta data
+   never has to be written in place while the journal is enabled. */
+static struct list free_blocks;
+/* The log header and the copies written to the log, LOG_SECTORS
+   sectors of them. */
+static struct journal_header *header;
+static uint8_t *log_data;
+/* Statistics. */
+static int commits;
+static int sectors_logged;
+
+static void enable (void);
+static bool has_room (struct transaction *);
+static void commit (bool make_room);
+static struct journal_block *find_block (struct transaction *,
+                                         block_sector_t sector);
+static void log_block (struct transaction *, block_sector_t sector,
+                       const void *data);
+static void write_transaction (struct transaction *);
+static void write_log (struct journal_block *blocks[], size_t cnt);
+static void write_in_place (size_t cnt);
+static unsigned block_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool block_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
+static int block_compare (const void *a, const void *b);
+static void block_free (struct hash_elem *e, void *aux UNUSED);
+
+/* Initializes the journal module.  The journal stays disabled until
+   journal_create() or journal_recover() finds it. */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  lock_init (&commit_lock);
+  cond_init (&closing_done);
+  ASSERT (sizeof *header == BLOCK_SECTOR_SIZE);
+  header = malloc (sizeof *header);
+  if (header == NULL)
+    PANIC ("journal allocation failed");
+}
+
+/* Writes an empty journal to a newly formatted file system, whose
+   free map has reserved its sectors, and enables it. */
+void
+journal_create (void)
+{
+  enable ();
+  header->magic = JOURNAL_MAGIC;
+  header->seq = 0;
+  header->cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, header);
+}
+
+/* Looks for a journal on the file system and enables it if there is
+   one.  If the system crashed after committing a transaction and
+   before it was written in place, writes it in place.  Must be
+   called before any meta data is read. */
+void
+journal_recover (void)
+{
+  block_read (fs_device, JOURNAL_SECTOR, header);
+  if (header->magic != JOURNAL_MAGIC || header->cnt > LOG_SECTORS)
+    {
+      /* A file system formatted without a journal. */
+      return;
+    }
+  enable ();
+  if (header->cnt > 0)
+    {
+      printf ("journal: replaying %"PRIu32" sectors of commit %"PRIu32"\n",
+              header->cnt, header->seq);
+      block_read_multiple (fs_device, JOURNAL_SECTOR + 1, log_data,
+                           header->cnt);
+      write_in_place (header->cnt);
+    }
+}
+
+/* Commits the running transaction and disables the journal, so that
+   meta data is written in place from now on. */
+void
+journal_done (void)
+{
+  if (!enabled)
+    return;
+  journal_commit ();
+  enabled = false;
+  printf ("journal: %d commits, %d sectors logged\n", commits,
+          sectors_logged);
+}
+
+/* Allocates the transactions, the copies and the log data and
+   enables the journal. */
+static void
+enable (void)
+{
+  size_t page_cnt = DIV_ROUND_UP (LOG_SECTORS * BLOCK_SECTOR_SIZE, PGSIZE);
+  struct journal_block *blocks;
+  size_t i;
+
+  log_data = palloc_get_multiple (PAL_ASSERT, page_cnt);
+  page_cnt = DIV_ROUND_UP (POOL_BLOCKS * sizeof *blocks, PGSIZE);
+  blocks = palloc_get_multiple (PAL_ASSERT, page_cnt);
+  list_init (&free_blocks);
+  for (i = 0; i < POOL_BLOCKS; i++)
+    list_push_back (&free_blocks, &blocks[i].free_elem);
+  for (i = 0; i < 2; i++)
+    {
+      if (!hash_init (&transactions[i].blocks, block_hash, block_less, NULL))
+        PANIC ("journal allocation failed");
+      transactions[i].release_cnt = 0;
+      transactions[i].active = 0;
+    }
+  running = &transactions[0];
+  enabled = true;
+}
+
+/* Begins a file system operation, which may change up to
+   OP_SECTORS sectors of meta data.  The meta data it changes is
+   committed together, after it ends.  Operations may be nested, in
+   which case the outermost one counts.  If the running transaction
+   has no room for it, waits until it has been committed. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (!enabled)
+    return;
+  if (t->txn_depth > 0)
+    {
+      t->txn_depth++;
+      return;
+    }
+
+  /* The thread isn't in an operation while it waits, because
+     committing releases sectors to the free map, which begins
+     one. */
+  lock_acquire (&journal_lock);
+  while (!has_room (running))
+    {
+      lock_release (&journal_lock);
+      commit (true);
+      lock_acquire (&journal_lock);
+    }
+  t->txn = running;
+  t->txn_depth = 1;
+  running->active++;
+  lock_release (&journal_lock);
+}
+
+/* Ends a file system operation begun with journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  if (!enabled || --t->txn_depth > 0)
+    return;
+  lock_acquire (&journal_lock);
+  if (--t->txn->active == 0 && t->txn == closing)
+    cond_signal (&closing_done, &journal_lock);
+  t->txn = NULL;
+  lock_release (&journal_lock);
+}
+
+/* Ends the current operation and begins another, unless it's
+   nested in another operation, so that the steps of a long one are
+   committed separately.  See the comment at the top of the file. */
+void
+journal_restart (void)
+{
+  if (!enabled || thread_current ()->txn_depth != 1)
+    return;
+  journal_end ();
+  journal_begin ();
+}
+
+/* Commits the running transaction, if it changed anything, and
+   writes it in place. */
+void
+journal_commit (void)
+{
+  if (enabled)
+    commit (false);
+}
+
+/* Returns true if TXN has room for another operation.  journal_lock
+   must be held. */
+static bool
+has_room (struct transaction *txn)
+{
+  return (hash_size (&txn->blocks) + (txn->active + 1) * OP_SECTORS
+          <= LOG_SECTORS);
+}
+
+/* Commits the running transaction and writes it in place.  If
+   MAKE_ROOM is true, does so unless the running transaction has
+   room for another operation, waiting for the operations in it to
+   end.  Otherwise does so if it changed anything. */
+static void
+commit (bool make_room)
+{
+  struct thread *t = thread_current ();
+  struct transaction *txn;
+  size_t i;
+  bool skip;
+
+  ASSERT (t->txn_depth == 0);
+
+  lock_acquire (&commit_lock);
+  lock_acquire (&journal_lock);
+  txn = running;
+  if (make_room)
+    skip = has_room (txn);
+  else
+    skip = hash_empty (&txn->blocks) && txn->release_cnt == 0;
+  if (skip)
+    {
+      lock_release (&journal_lock);
+      lock_release (&commit_lock);
+      return;
+    }
+  closing = txn;
+  running = txn == &transactions[0] ? &transactions[1] : &transactions[0];
+  if (txn->release_cnt > 0)
+    {
+      /* Join the new running transaction, which is empty, to return
+         TXN's releases once it's written. */
+      t->txn = running;
+      t->txn_depth = 1;
+      running->active++;
+    }
+  while (txn->active > 0)
+    cond_wait (&closing_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* Nothing changes TXN any more: releases go into the running
+     transaction. */
+  write_transaction (txn);
+
+  lock_acquire (&journal_lock);
+  closing = NULL;
+  hash_clear (&txn->blocks, block_free);
+  lock_release (&journal_lock);
+
+  /* TXN can't run again until commit_lock is released. */
+  for (i = 0; i < txn->release_cnt; i++)
+    free_map_release (txn->releases[i].sector, txn->releases[i].cnt);
+  txn->release_cnt = 0;
+  if (t->txn_depth > 0)
+    journal_end ();
+  lock_release (&commit_lock);
+}
+
+/* Adds a copy of DATA, the new contents of meta data SECTOR, to the
+   transaction of the current operation, which must be in progress,
+   since its room is what the copy uses.  Returns true if successful,
+   in which case the caller must not write SECTOR in place, or false
+   if the journal is disabled. */
+bool
+journal_log (block_sector_t sector, const void *data)
+{
+  struct thread *t = thread_current ();
+  struct transaction *txn;
+
+  if (!enabled)
+    return false;
+  ASSERT (t->txn != NULL);
+  lock_acquire (&journal_lock);
+  txn = t->txn;
+  log_block (txn, sector, data);
+
+  /* The newest copy of a sector must be in the newest transaction,
+     which is written in place last. */
+  if (txn != running && find_block (running, sector) != NULL)
+    log_block (running, sector, data);
+  lock_release (&journal_lock);
+  return true;
+}
+
+/* If a transaction that hasn't been written in place yet holds
+   SECTOR, copies its latest contents into DATA and returns true.
+   Otherwise returns false, and the sector on disk is up to date. */
+bool
+journal_read (block_sector_t sector, void *data)
+{
+  struct journal_block *block = NULL;
+
+  if (!enabled)
+    return false;
+  lock_acquire (&journal_lock);
+  block = find_block (running, sector);
+  if (block == NULL && closing != NULL)
+    block = find_block (closing, sector);
+  if (block != NULL)
+    memcpy (data, block->data, BLOCK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+  return block != NULL;
+}
+
+/* Called when CNT sectors starting at SECTOR are released to the free
+   map.  If a transaction that hasn't been written in place holds any
+   of them, remembers to release them once the running transaction
+   has been written and returns true.  Otherwise returns false, and
+   the caller should release them now. */
+bool
+journal_defer_release (block_sector_t sector, size_t cnt)
+{
+  struct journal_release *release;
+  bool deferred = false;
+  size_t i;
+
+  if (!enabled)
+    return false;
+  lock_acquire (&journal_lock);
+  for (i = 0; i < cnt; i++)
+    if (find_block (running, sector + i) != NULL
+        || (closing != NULL && find_block (closing, sector + i) != NULL))
+      {
+        /* See MAX_RELEASES. */
+        if (running->release_cnt >= MAX_RELEASES)
+          PANIC ("journal transaction too large");
+        release = &running->releases[running->release_cnt++];
+        release->sector = sector;
+        release->cnt = cnt;
+        deferred = true;
+        break;
+      }
+  lock_release (&journal_lock);
+  return deferred;
+}
+
+/* Returns TXN's copy of SECTOR, or a null pointer if it has none.
+   journal_lock must be held. */
+static struct journal_block *
+find_block (struct transaction *txn, block_sector_t sector)
+{
+  struct journal_block key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&txn->blocks, &key.elem);
+  return e != NULL ? hash_entry (e, struct journal_block, elem) : NULL;
+}
+
+/* Stores DATA as TXN's copy of SECTOR.  journal_lock must be
+   held. */
+static void
+log_block (struct transaction *txn, block_sector_t sector, const void *data)
+{
+  struct journal_block *block = find_block (txn, sector);
+
+  if (block == NULL)
+    {
+      /* Operations hold room for their copies, so this only happens
+         if one changed more than OP_SECTORS sectors. */
+      if (list_empty (&free_blocks))
+        PANIC ("journal transaction too large");
+      block = list_entry (list_pop_front (&free_blocks),
+                          struct journal_block, free_elem);
+      block->sector = sector;
+      hash_insert (&txn->blocks, &block->elem);
+    }
+  memcpy (block->data, data, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes the copies in TXN to the log and then in place. */
+static void
+write_transaction (struct transaction *txn)
+{
+  struct journal_block *blocks[LOG_SECTORS];
+  struct hash_iterator i;
+  size_t cnt = 0;
+
+  ASSERT (hash_size (&txn->blocks) <= LOG_SECTORS);
+
+  hash_first (&i, &txn->blocks);
+  while (hash_next (&i))
+    blocks[cnt++] = hash_entry (hash_cur (&i), struct journal_block, elem);
+  if (cnt > 0)
+    write_log (blocks, cnt);
+}
+
+/* Commits the CNT copies in BLOCKS by writing them to the log, and
+   then writes them in place. */
+static void
+write_log (struct journal_block *blocks[], size_t cnt)
+{
+  size_t i;
+
+  ASSERT (cnt <= LOG_SECTORS);
+
+  qsort (blocks, cnt, sizeof *blocks, block_compare);
+  for (i = 0; i < cnt; i++)
+    {
+      memcpy (log_data + i * BLOCK_SECTOR_SIZE, blocks[i]->data,
+              BLOCK_SECTOR_SIZE);
+      header->home[i] = blocks[i]->sector;
+    }
+  block_write_multiple (fs_device, JOURNAL_SECTOR + 1, log_data, cnt);
+  header->seq++;
+  header->cnt = cnt;
+  block_write (fs_device, JOURNAL_SECTOR, header);
+  commits++;
+  sectors_logged += cnt;
+  write_in_place (cnt);
+}
+
+/* Writes the CNT copies in the log, which are in log_data and sorted
+   by sector, in place, and then clears the log header. */
+static void
+write_in_place (size_t cnt)
+{
+  size_t i, j;
+
+  for (i = 0; i < cnt; i = j)
+    {
+      for (j = i + 1; j < cnt && header->home[j] == header->home[j - 1] + 1;
+           j++)
+        continue;
+      block_write_multiple (fs_device, header->home[i],
+                            log_data + i * BLOCK_SECTOR_SIZE, j - i);
+    }
+  header->cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, header);
+}
+
+static unsigned
+block_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct journal_block, elem)->sector);
+}
+
+static bool
+block_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct journal_block, elem)->sector
+          < hash_entry (b, struct journal_block, elem)->sector);
+}
+
+static int
+block_compare (const void *a_, const void *b_)
+{
+  const struct journal_block *const *a = a_;
+  const struct journal_block *const *b = b_;
+
+  return (*a)->sector < (*b)->sector ? -1 : (*a)->sector > (*b)->sector;
+}
+
+/* Returns a copy to free_blocks.  journal_lock must be held. */
+static void
+block_free (struct hash_elem *e, void *aux UNUSED)
+{
+  struct journal_block *block = hash_entry (e, struct journal_block, elem);
+
+  list_push_back (&free_blocks, &block->free_elem);
+}
@@ -0,0 +1,20 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+void journal_init (void);
+void journal_create (void);
+void journal_recover (void);
+void journal_done (void);
+void journal_begin (void);
+void journal_end (void);
+void journal_restart (void);
+void journal_commit (void);
+bool journal_log (block_sector_t sector, const void *data);
+bool journal_read (block_sector_t sector, void *data);
+bool journal_defer_release (block_sector_t sector, size_t cnt);
+
+#endif /* filesys/journal.h */
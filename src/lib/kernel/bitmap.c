@@ -223,8 +223,15 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  for (i = start; i < start + cnt; )
+    if (i % ELEM_BITS == 0 && start + cnt - i >= ELEM_BITS)
+      {
+        /* Set a whole element at once. */
+        b->bits[elem_idx (i)] = value ? (elem_type) -1 : 0;
+        i += ELEM_BITS;
+      }
+    else
+      bitmap_set (b, i++, value);
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -250,16 +257,7 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
-  ASSERT (b != NULL);
-  ASSERT (start <= b->bit_cnt);
-  ASSERT (start + cnt <= b->bit_cnt);
-
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return bitmap_find (b, start, cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -288,6 +286,39 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+/* Returns the index of the first bit in B between START and 
+   START + CNT, exclusive, that is set to VALUE, or START + CNT if
+   there is none.  Looks at a whole element at a time. */
+size_t
+bitmap_find (const struct bitmap *b, size_t start, size_t cnt, bool value) 
+{
+  size_t end = start + cnt;
+  size_t i = start;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  while (i < end)
+    {
+      /* Bits of the element holding bit I, at or after I, that 
+         are set to VALUE. */
+      elem_type bits = b->bits[elem_idx (i)];
+      if (!value)
+        bits = ~bits;
+      bits &= (elem_type) -1 << (i % ELEM_BITS);
+
+      i -= i % ELEM_BITS;
+      if (bits != 0)
+        {
+          i += __builtin_ctzl (bits);
+          return i < end ? i : end;
+        }
+      i += ELEM_BITS;
+    }
+  return end;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
@@ -298,13 +329,27 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
+  if (cnt == 0)
+    return start;
   if (cnt <= b->bit_cnt) 
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+      while (i <= last)
+        {
+          /* Skip to the next bit set to VALUE and see whether
+             the run it starts is long enough.  If not, the run
+             ends at a bit set to !VALUE, so start over after it. */
+          size_t end;
+
+          i = bitmap_find (b, i, b->bit_cnt - i, value);
+          if (i > last)
+            break;
+          end = bitmap_find (b, i, cnt, !value);
+          if (end == i + cnt)
+            return i;
+          i = end + 1;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -358,6 +403,26 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds the CNT bits starting at START
+   to the same place in FILE, which must already hold the rest of
+   B.  Return true if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t start, size_t cnt)
+{
+  off_t ofs, size;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+  ofs = elem_idx (start) * sizeof (elem_type);
+  size = (elem_idx (start + cnt - 1) + 1) * sizeof (elem_type) - ofs;
+  return file_write_at (file, (char *) b->bits + ofs, size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
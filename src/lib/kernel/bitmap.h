@@ -34,6 +34,7 @@ bool bitmap_all (const struct bitmap *, size_t start, size_t cnt);
 
 /* Finding set or unset bits. */
 #define BITMAP_ERROR SIZE_MAX
+size_t bitmap_find (const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan (const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan_and_flip (struct bitmap *, size_t start, size_t cnt, bool);
 
@@ -43,6 +44,8 @@ struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
 bool bitmap_write (const struct bitmap *, struct file *);
+bool bitmap_write_part (const struct bitmap *, struct file *,
+                        size_t start, size_t cnt);
 #endif
 
 /* Debugging. */
@@ -44,5 +44,6 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+pid_t fork (void);
 
 #endif /* lib/user/syscall.h */
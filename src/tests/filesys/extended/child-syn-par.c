@@ -0,0 +1,55 @@
+/* Child process for syn-par.
+   Creates a file named after its index, writes it in chunks and
+   then reads it back, checking that the contents are correct.
+   Each child's file contents are a distinct slice of a single
+   random stream. */
+
+#include <random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/filesys/extended/syn-par.h"
+#include "tests/lib.h"
+
+const char *test_name = "child-syn-par";
+
+static char buf1[FILE_SIZE * CHILD_CNT];
+static char buf2[FILE_SIZE];
+
+int
+main (int argc, const char *argv[]) 
+{
+  char file_name[16];
+  const char *data;
+  int child_idx;
+  int fd;
+  size_t ofs;
+
+  quiet = true;
+  
+  CHECK (argc == 2, "argc must be 2, actually %d", argc);
+  child_idx = atoi (argv[1]);
+  snprintf (file_name, sizeof file_name, "file%d", child_idx);
+
+  random_init (0);
+  random_bytes (buf1, sizeof buf1);
+  data = buf1 + child_idx * FILE_SIZE;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+    CHECK (write (fd, data + ofs, CHUNK_SIZE) == CHUNK_SIZE,
+           "write %d bytes at offset %zu in \"%s\"",
+           CHUNK_SIZE, ofs, file_name);
+  seek (fd, 0);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+    {
+      CHECK (read (fd, buf2 + ofs, CHUNK_SIZE) == CHUNK_SIZE,
+             "read %d bytes at offset %zu in \"%s\"",
+             CHUNK_SIZE, ofs, file_name);
+      compare_bytes (buf2 + ofs, data + ofs, CHUNK_SIZE, ofs, file_name);
+    }
+  close (fd);
+
+  return child_idx;
+}
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my (%files) = ("child-syn-par" => "tests/filesys/extended/child-syn-par");
+$files{"file$_"} = [random_bytes (512 * 8)] foreach 0...7;
+check_archive (\%files);
+pass;
@@ -0,0 +1,17 @@
+/* Runs many processes in parallel, each of which writes its own
+   file and reads it back, so that the buffer cache is used by many
+   processes at the same time. */
+
+#include <syscall.h>
+#include "tests/filesys/extended/syn-par.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  pid_t children[CHILD_CNT];
+
+  exec_children ("child-syn-par", children, CHILD_CNT);
+  wait_children (children, CHILD_CNT);
+}
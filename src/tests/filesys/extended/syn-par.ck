@@ -0,0 +1,27 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(syn-par) begin
+(syn-par) exec child 1 of 8: "child-syn-par 0"
+(syn-par) exec child 2 of 8: "child-syn-par 1"
+(syn-par) exec child 3 of 8: "child-syn-par 2"
+(syn-par) exec child 4 of 8: "child-syn-par 3"
+(syn-par) exec child 5 of 8: "child-syn-par 4"
+(syn-par) exec child 6 of 8: "child-syn-par 5"
+(syn-par) exec child 7 of 8: "child-syn-par 6"
+(syn-par) exec child 8 of 8: "child-syn-par 7"
+(syn-par) wait for child 1 of 8 returned 0 (expected 0)
+(syn-par) wait for child 2 of 8 returned 1 (expected 1)
+(syn-par) wait for child 3 of 8 returned 2 (expected 2)
+(syn-par) wait for child 4 of 8 returned 3 (expected 3)
+(syn-par) wait for child 5 of 8 returned 4 (expected 4)
+(syn-par) wait for child 6 of 8 returned 5 (expected 5)
+(syn-par) wait for child 7 of 8 returned 6 (expected 6)
+(syn-par) wait for child 8 of 8 returned 7 (expected 7)
+(syn-par) end
+EOF
+# Report the buffer cache's per shard lock contention.
+my (@shards) = grep (/^cache shard/, read_text_file ("$test.output"));
+pass (@shards);
@@ -0,0 +1,9 @@
+#ifndef TESTS_FILESYS_EXTENDED_SYN_PAR_H
+#define TESTS_FILESYS_EXTENDED_SYN_PAR_H
+
+#define CHILD_CNT 8
+#define CHUNK_SIZE 512
+#define CHUNK_CNT 8
+#define FILE_SIZE (CHUNK_SIZE * CHUNK_CNT)
+
+#endif /* tests/filesys/extended/syn-par.h */
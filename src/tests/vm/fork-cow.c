@@ -0,0 +1,49 @@
+/* Forks, then has the child write to a global, a stack variable,
+   and a large array while the parent's copies stay unchanged. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (256 * 1024)
+
+static int global = 0x1234;
+static char buf[SIZE];
+
+void
+test_main (void)
+{
+  int local = 0x5678;
+  pid_t child;
+  size_t i;
+
+  msg ("initialize");
+  memset (buf, 0x5a, sizeof buf);
+
+  CHECK ((child = fork ()) != -1, "fork");
+  if (child == 0)
+    {
+      /* Child: dirty every shared page. */
+      global = 0;
+      local = 0;
+      memset (buf, 0xa5, sizeof buf);
+      if (global != 0 || local != 0)
+        fail ("child can't see its own writes");
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != (char) 0xa5)
+          fail ("child byte %zu != 0xa5", i);
+      exit (0x42);
+    }
+
+  CHECK (wait (child) == 0x42, "wait for child");
+
+  msg ("check parent");
+  if (global != 0x1234)
+    fail ("global changed to %#x", global);
+  if (local != 0x5678)
+    fail ("local changed to %#x", local);
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != 0x5a)
+      fail ("byte %zu != 0x5a", i);
+}
@@ -0,0 +1,40 @@
+/* Forks, then has the child read() a file into a buffer it
+   still shares with the parent.  The read must break the
+   sharing rather than write into the parent's page. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[sizeof sample];
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t i;
+
+  CHECK ((child = fork ()) != -1, "fork");
+  if (child == 0)
+    {
+      int handle = open ("sample.txt");
+      if (handle < 2)
+        fail ("child can't open \"sample.txt\"");
+      if (read (handle, buf, sizeof sample - 1) != sizeof sample - 1)
+        fail ("child's read of \"sample.txt\" came up short");
+      if (memcmp (buf, sample, sizeof sample - 1))
+        fail ("child read bad data");
+      close (handle);
+      exit (0x42);
+    }
+
+  CHECK (wait (child) == 0x42, "wait for child");
+
+  msg ("check parent");
+  for (i = 0; i < sizeof buf; i++)
+    if (buf[i] != 0)
+      fail ("byte %zu of parent's buffer has value %02hhx (should be 0)",
+            i, buf[i]);
+}
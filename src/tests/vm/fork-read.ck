@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fork-read) begin
+(fork-read) fork
+(fork-read) wait for child
+(fork-read) check parent
+(fork-read) end
+EOF
+pass;
@@ -0,0 +1,47 @@
+/* Fills 2 MB of memory, enough to push some of it out to swap,
+   then forks.  The child encrypts its copy and checks that it
+   decrypts back, while the parent checks that its own copy,
+   which shared swap slots with the child's, is intact. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/arc4.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (2 * 1024 * 1024)
+
+static char buf[SIZE];
+
+void
+test_main (void)
+{
+  struct arc4 arc4;
+  pid_t child;
+  size_t i;
+
+  msg ("initialize");
+  for (i = 0; i < SIZE; i++)
+    buf[i] = i * 257;
+
+  CHECK ((child = fork ()) != -1, "fork");
+  if (child == 0)
+    {
+      /* Child: encrypt, then decrypt, its copy. */
+      arc4_init (&arc4, "foobar", 6);
+      arc4_crypt (&arc4, buf, SIZE);
+      arc4_init (&arc4, "foobar", 6);
+      arc4_crypt (&arc4, buf, SIZE);
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != (char) (i * 257))
+          fail ("child byte %zu is wrong", i);
+      exit (0x42);
+    }
+
+  CHECK (wait (child) == 0x42, "wait for child");
+
+  msg ("check parent");
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != (char) (i * 257))
+      fail ("byte %zu is wrong", i);
+}
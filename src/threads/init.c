@@ -30,14 +30,17 @@
 #include "userprog/tss.h"
 #include "vm/frametable.h"
 #include "vm/swap.h"
+#include "vm/zswap.h"
 #else
 #include "tests/threads/tests.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/iosched.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/buffers.h"
 #include "filesys/inode.h"
 #endif
 
@@ -134,6 +137,7 @@ main (void)
 
 #ifdef USERPROG
   swap_init ();
+  frametable_start_pageout ();
 #endif
 
   printf ("Boot complete.\n");
@@ -256,9 +260,37 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        buffers_configure (atoi (value), strchr (value, '%') != NULL);
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!buffers_set_policy (value))
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (!iosched_set_policy (value))
+            PANIC ("unknown I/O scheduler `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-fs-layout"))
+        {
+          if (!inode_set_layout (value))
+            PANIC ("unknown inode layout `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
+      else if (!strcmp (name, "-pageout"))
+        {
+          int low = atoi (value);
+          int high = strchr (value, ',') != NULL
+                     ? atoi (strchr (value, ',') + 1) : 2 * low;
+          if (low < 0 || high < low)
+            PANIC ("bad pageout watermarks `%s' (use -h for help)", value);
+          frametable_set_watermarks (low, high);
+        }
+      else if (!strcmp (name, "-zswap"))
+        zswap_configure (atoi (value));
 #endif
 #endif
       else if (!strcmp (name, "-rs"))
@@ -382,8 +414,20 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=COUNT[%%]    Use COUNT buffers (or percent of kernel pages)\n"
+          "                     for the file system buffer cache.\n"
+          "  -cache-policy=NAME Use NAME (lru or 2q) to replace cache buffers.\n"
+          "  -iosched=NAME      Use NAME (noop, cscan, or deadline) to order\n"
+          "                     disk requests.\n"
+          "  -fs-layout=NAME    Format with NAME (blockmap or extent) inodes.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
+          "  -pageout=LOW[,HIGH]\n"
+          "                     Page out in the background when fewer than\n"
+          "                     LOW user pages are free, until HIGH (default\n"
+          "                     2*LOW) are.  LOW of 0 disables it.\n"
+          "  -zswap=COUNT       Keep compressed swapped pages in up to COUNT\n"
+          "                     kernel pages (0 disables).\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
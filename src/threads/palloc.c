@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -30,6 +31,7 @@ struct pool
   {
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
+    size_t free_cnt;                    /* Number of free pages. */
     uint8_t *base;                      /* Base of pool. */
   };
 
@@ -39,6 +41,7 @@ static struct pool kernel_pool, user_pool;
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static void count_pages (struct pool *, int page_cnt);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -80,6 +83,8 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   lock_acquire (&pool->lock);
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
   lock_release (&pool->lock);
+  if (page_idx != BITMAP_ERROR)
+    count_pages (pool, -(int) page_cnt);
 
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
@@ -139,6 +144,7 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  count_pages (pool, page_cnt);
 }
 
 /* Frees the page at PAGE. */
@@ -148,6 +154,26 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages in the user pool if PAL_USER is set in FLAGS,
+   otherwise in the kernel pool. */
+size_t
+palloc_page_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+
+  return bitmap_size (pool->used_map);
+}
+
+/* Returns the number of free pages in the user pool if PAL_USER is
+   set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+
+  return pool->free_cnt;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -167,6 +193,7 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->free_cnt = page_cnt;
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -180,3 +207,15 @@ page_from_pool (const struct pool *pool, void *page)
 
   return page_no >= start_page && page_no < end_page;
 }
+
+/* Adds PAGE_CNT to the number of free pages in POOL.  Pages are
+   freed without the pool's lock, sometimes with interrupts off
+   while switching threads, so the count is kept with interrupts 
+   off instead. */
+static void
+count_pages (struct pool *pool, int page_cnt)
+{
+  enum intr_level old_level = intr_disable ();
+  pool->free_cnt += page_cnt;
+  intr_set_level (old_level);
+}
@@ -169,6 +169,10 @@ struct thread
 #ifdef FILESYS
     /* The current working directory. */
     struct inode *cwd;
+    /* The journal transaction of the file system operation in
+       progress, and how deeply it's nested.  See filesys/journal.c. */
+    struct transaction *txn;
+    int txn_depth;
 #endif    
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
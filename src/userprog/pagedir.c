@@ -54,6 +54,31 @@ pagedir_destroy (uint32_t *pd)
   palloc_free_page (pd);
 }
 
+/* Gives the new page directory CHILD_PD a copy of every page in PD,
+   sharing their frames and swap slots copy-on-write.  Pages backed
+   by a file in FILES[] are backed by the file at the same index in
+   CHILD_FILES[] in the copy.  Memory mapped files aren't copied.
+   Returns false if memory allocation fails, in which case the pages
+   copied so far stay in CHILD_PD for pagedir_destroy() to unload. */
+bool
+pagedir_share (uint32_t *pd, uint32_t *child_pd, struct file **files,
+               struct file **child_files)
+{
+  uint32_t *pde;
+  void *ubase;
+  void *upage;
+
+  ASSERT (pd != init_page_dir);
+  ASSERT (child_pd != init_page_dir);
+  for (ubase = 0, pde = pd; pde < pd + pd_no (PHYS_BASE);
+       ubase += PTSPAN, pde++)
+    if (*pde & PTE_P)
+      for (upage = ubase; upage < ubase + PTSPAN; upage += PGSIZE)
+        if (!frametable_share_page (pd, upage, child_pd, files, child_files))
+          return false;
+  return true;
+}
+
 /* Returns the address of the page table entry for virtual
    address VADDR in page directory PD.
    If PD does not have a page table for VADDR, behavior depends
@@ -221,6 +246,22 @@ pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed)
     }
 }
 
+/* Sets the writable bit to WRITABLE in the PTE for virtual page
+   VPAGE in PD. */
+void
+pagedir_set_writable (uint32_t *pd, const void *vpage, bool writable) 
+{
+  uint32_t *pte = lookup_page (pd, vpage, false);
+  if (pte != NULL) 
+    {
+      if (writable)
+        *pte |= PTE_W;
+      else 
+        *pte &= ~(uint32_t) PTE_W; 
+      invalidate_pagedir (pd);
+    }
+}
+
 /* Loads page directory PD into the CPU's page directory base
    register. */
 void
@@ -5,9 +5,12 @@
 #include <stdint.h>
 
 struct page_info;
+struct file;
 
 uint32_t *pagedir_create (void);
 void pagedir_destroy (uint32_t *pd);
+bool pagedir_share (uint32_t *pd, uint32_t *child_pd, struct file **files,
+                    struct file **child_files);
 bool pagedir_set_page (uint32_t *pd, const void *upage, void *kpage, bool rw);
 void *pagedir_get_page (uint32_t *pd, const void *uaddr);
 void pagedir_clear_page (uint32_t *pd, const void *upage);
@@ -15,6 +18,7 @@ bool pagedir_is_dirty (uint32_t *pd, const void *vpage);
 void pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty);
 bool pagedir_is_accessed (uint32_t *pd, const void *vpage);
 void pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed);
+void pagedir_set_writable (uint32_t *pd, const void *vpage, bool writable);
 void pagedir_activate (uint32_t *pd);
 void pagedir_unload_page (uint32_t *pd, const void *upage);
 bool pagedir_set_info (uint32_t *pd, const void *upage, struct page_info *info);
@@ -33,7 +33,18 @@ struct start_args
   struct thread *child;
 };
 
+/* Arguments passed to a process forked by process_fork(). */
+struct fork_args
+{
+  struct thread *parent;
+  /* The parent's user registers when it called fork. */
+  struct intr_frame if_;
+  struct semaphore start_wait;
+  struct thread *child;
+};
+
 static thread_func start_process NO_RETURN;
+static thread_func fork_process NO_RETURN;
 static bool load (char *program_name, char *program_args, void (**eip) (void),
                   void **esp);
 
@@ -114,6 +125,92 @@ start_process (void *args_)
   NOT_REACHED ();
 }
 
+/* Starts a new process that is a copy of the current one, which 
+   entered the kernel with the user registers in F, and returns the 
+   new process's thread id, or TID_ERROR if it can't be created.  The
+   copy shares the current process's pages copy-on-write, and gets 
+   its own copy of each open file.  Memory mapped files aren't
+   copied.  The new process returns 0 from the system call. */
+tid_t
+process_fork (const struct intr_frame *f)
+{
+  struct thread *cur = thread_current ();
+  struct fork_args args;
+  tid_t tid;
+
+  args.parent = cur;
+  args.if_ = *f;
+  sema_init (&args.start_wait, 0);
+  tid = thread_create (cur->name, PRI_DEFAULT, fork_process, &args);
+  if (tid != TID_ERROR)
+    {
+      /* Wait for the copy to be made.  The pages can't change while
+         this process waits. */
+      sema_down (&args.start_wait);
+      if (args.child != NULL)
+        list_push_back (&cur->child_list, &args.child->child_elem);
+      else
+        tid = TID_ERROR;
+    }
+  return tid;
+}
+
+/* A thread function that copies the process that forked it and 
+   starts the copy running. */
+static void
+fork_process (void *args_)
+{
+  struct thread *cur = thread_current ();
+  struct fork_args *args = args_;
+  struct thread *parent = args->parent;
+  struct intr_frame if_ = args->if_;
+  bool success = false;
+  int fd;
+
+  cur->pagedir = pagedir_create ();
+  if (cur->pagedir == NULL)
+    goto done;
+  process_activate ();
+  cur->ofiles = calloc (MAX_OPEN_FILES, sizeof *cur->ofiles);
+  if (cur->ofiles == NULL)
+    goto done;
+  cur->mfiles = calloc (MAX_MMAP_FILES, sizeof *cur->mfiles);
+  if (cur->mfiles == NULL)
+    goto done;
+  for (fd = 2; fd < MAX_OPEN_FILES; fd++)
+    if (parent->ofiles[fd] != NULL)
+      {
+        cur->ofiles[fd] = file_dup (parent->ofiles[fd]);
+        if (cur->ofiles[fd] == NULL)
+          goto done;
+      }
+  if (!pagedir_share (parent->pagedir, cur->pagedir, parent->ofiles,
+                      cur->ofiles))
+    goto done;
+  cur->user_esp = if_.esp;
+  /* Return 0 from fork. */
+  if_.eax = 0;
+  success = true;
+
+ done:
+  if (success)
+    {
+      args->child = cur;
+      cur->ptid = parent->tid;
+    }
+  else
+    args->child = NULL;
+  sema_up (&args->start_wait);
+
+  /* If copying failed, quit. */
+  if (!success)
+    thread_exit ();
+
+  /* Start the user process like start_process() does. */
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
 /* Waits for thread TID to die and returns its exit status.  If
    it was terminated by the kernel (i.e. killed due to an
    exception), returns -1.  If TID is invalid or if it was not a
@@ -37,6 +37,7 @@ static int sys_mkdir(const uint8_t *arg_base);
 static int sys_readdir(const uint8_t *arg_base);
 static int sys_isdir(const uint8_t *arg_base);
 static int sys_inumber(const uint8_t *arg_base);
+static int sys_fork(const struct intr_frame *f);
 
 static int (*syscalls[])(const uint8_t *arg_base) =
 {
@@ -59,7 +60,7 @@ static int (*syscalls[])(const uint8_t *arg_base) =
   [SYS_MKDIR] sys_mkdir,    
   [SYS_READDIR] sys_readdir,
   [SYS_ISDIR] sys_isdir,
-  [SYS_INUMBER] sys_inumber              
+  [SYS_INUMBER] sys_inumber
 };
 
 void
@@ -183,8 +184,11 @@ syscall_handler (struct intr_frame *f)
   thread_current ()->user_esp = f->esp;
   if (!get_int_arg (f->esp, 0, (int *) &num))
     thread_exit ();
-  if (num > 0 && num < sizeof syscalls / sizeof *syscalls
-      && syscalls[num] != NULL)
+  /* Fork copies the user registers, not just the arguments. */
+  if (num == SYS_FORK)
+    f->eax = sys_fork (f);
+  else if (num > 0 && num < sizeof syscalls / sizeof *syscalls
+           && syscalls[num] != NULL)
     f->eax = syscalls[num] ((uint8_t *) f->esp + sizeof (int));
   else
     f->eax = -1;
@@ -421,6 +425,7 @@ sys_readdir(const uint8_t *arg_base)
 {
   int fd;
   void *name;
+  bool success;
 
   if (!get_int_arg (arg_base, 0, &fd)
       || !get_int_arg (arg_base, 1, (int *) &name)
@@ -429,7 +434,12 @@ sys_readdir(const uint8_t *arg_base)
       || name > name + NAME_MAX + 1)
     thread_exit ();
 
-  return fd_readdir (fd, name);
+  if (!lock_buffer (name, NAME_MAX + 1, true))
+    thread_exit ();
+  success = fd_readdir (fd, name);
+  unlock_buffer (name, NAME_MAX + 1);
+
+  return success;
 }
 
 static int
@@ -453,3 +463,9 @@ sys_inumber(const uint8_t *arg_base)
 
     return fd_inumber (fd);
 }
+
+static int
+sys_fork (const struct intr_frame *f)
+{
+  return process_fork (f);
+}
@@ -12,9 +12,24 @@
 #include "threads/malloc.h"
 #include "threads/vaddr.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
 #include "filesys/filesys.h"
+
+/* Number of frames past the clock hand examined for more frames to
+   write to swap along with the one being evicted. */
+#define CLUSTER_SCAN (2 * SWAP_CLUSTER_MAX)
+
+/* Maximum number of pages read in along with a faulting page: its
+   neighbours that were swapped out to the neighbouring swap slots,
+   or the pages that follow it in a file mapping. */
+#define READ_AROUND_MAX (SWAP_CLUSTER_MAX - 1)
+
+/* Default free frame watermarks, in pages. */
+#define PAGEOUT_LOW_DEFAULT  16
+#define PAGEOUT_HIGH_DEFAULT 32
+
 /* Additional file information, only relevant if the page is backed by a 
    file. */
 struct file_info
@@ -48,6 +63,13 @@ struct page_info
   /* If true the page is swapped and its contents can be read back
      from swap_sector. */
   bool swapped;
+  /* If true the page was read in along with a faulting page and
+     hasn't been checked for having been accessed since. */
+  bool prefetched;
+  /* If true the page is writable but shares its frame with a copy of
+     it in another address space, and is mapped read-only until it's
+     written to. */
+  bool cow;
   /* Information about the frame backing the page. */
   struct frame *frame;
   /* Depending on the type this can be information about the backing file, the 
@@ -94,16 +116,52 @@ static struct list frame_list;
    points to the next frame to examine. */
 static struct list_elem *clock_hand;
 
+/* When fewer than LOW_WATER user pages are free, the pageout thread
+   evicts frames until HIGH_WATER are, so that page faults usually
+   find a free frame instead of evicting one themselves.  The 
+   pageout thread isn't started if LOW_WATER is 0. */
+static size_t low_water = PAGEOUT_LOW_DEFAULT;
+static size_t high_water = PAGEOUT_HIGH_DEFAULT;
+/* Signaled when free frames run short. */
+static struct condition pageout_wanted;
+/* Broadcast when a frame is unlocked or freed. */
+static struct condition frame_available;
+
+/* Statistics. */
+static int prefetches;          /* Pages read in with a faulting page. */
+static int faults_avoided;      /* Prefetched pages accessed later. */
+static int pageouts;            /* Frames freed by the pageout thread. */
+static int cow_shares;          /* Frames shared copy-on-write. */
+static int cow_copies;          /* Frames copied on a write. */
+
 static void frame_init (struct frame *frame);
 static struct frame *allocate_frame (void);
+static struct frame *new_frame (void);
 static bool load_frame (uint32_t *pd, const void *upage, bool write,
                         bool keep_locked);
 static void map_page (struct page_info *page_info, struct frame *frame,
                       const void *upage);
+static bool break_cow (struct page_info *page_info);
+static struct file *child_file (struct file *file, struct file **files,
+                                struct file **child_files);
 static void wait_for_io_done (struct frame **frame);
+static size_t swap_read_around (struct page_info *page_info,
+                                struct page_info *pages[]);
+static size_t file_read_ahead (struct page_info *page_info,
+                               struct page_info *pages[]);
+static struct page_info *get_neighbour (struct page_info *page_info, int i);
+static bool prefetch_page (struct page_info *page_info);
+static void finish_prefetch (struct page_info *pages[], size_t cnt);
+static bool test_accessed (struct page_info *page_info);
 static struct frame *lookup_read_only_frame (struct page_info *page_info);
 static void *evict_frame (void);
 static void *get_frame_to_evict (void);
+static size_t get_swap_cluster (struct frame *frames[], size_t max);
+static bool is_swap_frame (struct frame *frame);
+static void free_evicted_frame (struct frame *frame);
+static void release_frame (struct frame *frame);
+static void unlock_frame (struct frame *frame);
+static void pageout (void *aux UNUSED);
 static unsigned frame_hash (const struct hash_elem *e, void *aux UNUSED);
 static bool frame_less (const struct hash_elem *a, const struct hash_elem *b,
                         void *aux UNUSED);
@@ -168,6 +226,48 @@ frametable_init (void)
   list_init (&frame_list);
   clock_hand = list_end (&frame_list);
   hash_init (&read_only_frames, frame_hash, frame_less, NULL);
+  cond_init (&pageout_wanted);
+  cond_init (&frame_available);
+}
+
+/* Keeps between LOW and HIGH user pages free, or disables the 
+   pageout thread if LOW is 0.  Must be called before 
+   frametable_start_pageout(). */
+void
+frametable_set_watermarks (size_t low, size_t high)
+{
+  ASSERT (low <= high);
+  low_water = low;
+  high_water = high;
+}
+
+/* Starts the pageout thread, unless it has been disabled.  Pages
+   may be written to swap from then on.  The watermarks are cut down
+   to a quarter of the user pool, so that a small pool isn't paged
+   out entirely. */
+void
+frametable_start_pageout (void)
+{
+  size_t max = palloc_page_cnt (PAL_USER) / 4;
+
+  if (high_water > max)
+    {
+      low_water = low_water * max / high_water;
+      high_water = max;
+    }
+  if (low_water > 0)
+    thread_create ("pageout", PRI_DEFAULT, pageout, NULL);
+}
+
+/* Prints paging statistics. */
+void
+frametable_print_stats (void)
+{
+  printf ("Paging: %d pages prefetched, %d major faults avoided, "
+          "%d frames paged out in the background\n",
+          prefetches, faults_avoided, pageouts);
+  printf ("Copy-on-write: %d frames shared, %d copied\n",
+          cow_shares, cow_copies);
 }
 
 /* Reads data into a frame from the appropriate place and maps the
@@ -191,6 +291,7 @@ frametable_unload_frame (uint32_t *pd, const void *upage)
   struct frame *frame;
   off_t bytes_written;
   struct list_elem *e;
+  bool last;
 
   ASSERT (is_user_vaddr (upage));
   page_info = pagedir_get_info (pd, upage);
@@ -237,12 +338,17 @@ frametable_unload_frame (uint32_t *pd, const void *upage)
           list_remove (&page_info->elem);
           list_remove (&frame->list_elem);
         }
+      test_accessed (page_info);
       pagedir_clear_page (page_info->pd, upage);
       /* At this point the frame has been removed from the shared data
          structures and it's safe to release the lock and, if necessary,
-         free the resources associated with the frame. */
+         free the resources associated with the frame.  Whether this
+         page was the last one must be decided before then: once the
+         lock is released, another page sharing the frame can free
+         it. */
+      last = list_empty (&frame->page_info_list);
       lock_release (&frame_lock);
-      if (list_empty (&frame->page_info_list))
+      if (last)
         {
           if (page_info->writable & WRITABLE_TO_FILE
               && pagedir_is_dirty (page_info->pd, upage))
@@ -281,6 +387,91 @@ frametable_unload_frame (uint32_t *pd, const void *upage)
   free (page_info);
 }
 
+/* Gives the page directory CHILD_PD a copy of the page UPAGE in PD,
+   if it has one, unless it's in a memory mapped file.  A loaded page
+   shares its frame with the copy.  If the page is writable, both are
+   mapped read-only until one of them is written to and given a copy
+   of the frame.  A swapped page shares its swap slot, and a page
+   that hasn't been loaded yet is loaded independently.  A file 
+   backed page must be backed by one of the files in FILES[], which
+   is replaced by the file at the same index in CHILD_FILES[].
+   Returns false if memory allocation fails. */
+bool
+frametable_share_page (uint32_t *pd, const void *upage, uint32_t *child_pd,
+                       struct file **files, struct file **child_files)
+{
+  struct page_info *page_info, *copy;
+  struct file *file;
+  void *kpage;
+  bool success = true;
+
+  ASSERT (is_user_vaddr (upage));
+  page_info = pagedir_get_info (pd, upage);
+  if (page_info == NULL || page_info->writable & WRITABLE_TO_FILE)
+    return true;
+  copy = pageinfo_create ();
+  if (copy == NULL || !pagedir_set_info (child_pd, upage, copy))
+    {
+      free (copy);
+      return false;
+    }
+  copy->type = page_info->type;
+  copy->writable = page_info->writable;
+  copy->pd = child_pd;
+  copy->upage = upage;
+  lock_acquire (&frame_lock);
+  /* Wait for the page to finish being read in or evicted, so that 
+     it's either loaded or its data is in swap or its file. */
+  wait_for_io_done (&page_info->frame);
+  if (page_info->swapped)
+    {
+      swap_share (page_info->data.swap_sector);
+      copy->swapped = true;
+      copy->data.swap_sector = page_info->data.swap_sector;
+    }
+  else if (page_info->frame != NULL && page_info->writable != 0)
+    {
+      /* The frame is all there is of a loaded writable page. */
+    }
+  else if (page_info->type & PAGE_TYPE_FILE)
+    {
+      file = child_file (page_info->data.file_info.file, files, child_files);
+      pageinfo_set_fileinfo (copy, file, page_info->data.file_info.end_offset);
+      success = file != NULL;
+    }
+  else if (page_info->type & PAGE_TYPE_KERNEL)
+    {
+      kpage = palloc_get_page (0);
+      if (kpage != NULL)
+        memcpy (kpage, page_info->data.kpage, PGSIZE);
+      pageinfo_set_kpage (copy, kpage);
+      success = kpage != NULL;
+    }
+  if (success && page_info->frame != NULL)
+    {
+      if (page_info->writable != 0)
+        {
+          if (!page_info->cow)
+            {
+              page_info->cow = true;
+              pagedir_set_writable (pd, upage, false);
+              cow_shares++;
+            }
+          copy->cow = true;
+        }
+      map_page (copy, page_info->frame, upage);
+      /* Let the clock judge the frame by the original's use. */
+      pagedir_set_accessed (child_pd, upage, false);
+    }
+  lock_release (&frame_lock);
+  if (!success)
+    {
+      pagedir_set_info (child_pd, upage, NULL);
+      free (copy);
+    }
+  return success;
+}
+
 /* Identical to frametale_load_frame with the exception that,
    upon return, the frame is locked to prevent it from being evicted. */
 bool
@@ -302,7 +493,7 @@ frametable_unlock_frame(uint32_t *pd, const void *upage)
     return;
   ASSERT (page_info->frame != NULL);
   lock_acquire (&frame_lock);
-  page_info->frame->lock--;
+  unlock_frame (page_info->frame);
   lock_release (&frame_lock);
 }
 
@@ -312,6 +503,11 @@ load_frame (uint32_t *pd, const void *upage, bool write, bool keep_locked)
   struct page_info *page_info;
   struct file_info *file_info;
   struct frame *frame = NULL;
+  struct page_info *pages[SWAP_CLUSTER_MAX];
+  void *kpages[SWAP_CLUSTER_MAX];
+  struct page_info *p;
+  block_sector_t first = 0;
+  size_t cnt, i;
   void *kpage;
   off_t bytes_read;
   bool success = false;
@@ -329,13 +525,22 @@ load_frame (uint32_t *pd, const void *upage, bool write, bool keep_locked)
      wait_for_io_done returns, frame_lock will be held and frame will be
      NULL. */
   wait_for_io_done (&page_info->frame);
-  ASSERT (page_info->frame == NULL || keep_locked);
+  ASSERT (page_info->frame == NULL || keep_locked
+          || (write && page_info->cow));
   if (page_info->frame != NULL)
     {
-      if (keep_locked)
+      /* A kernel write to a copy-on-write page faults like a user
+         one (CR0_WP is set), but by then the file system may hold
+         locks that copying, which can evict, needs.  So a locked
+         page about to be written is copied now. */
+      if (write && page_info->cow)
+        success = break_cow (page_info);
+      else
+        success = true;
+      if (success && keep_locked)
         page_info->frame->lock++;
       lock_release (&frame_lock);
-      return true;
+      return success;
     }
   /* Attempt to satisfy a read only page by looking it up in the 
      cache. */
@@ -354,7 +559,7 @@ load_frame (uint32_t *pd, const void *upage, bool write, bool keep_locked)
              after it's loaded in and before the page is mapped. */
           frame->lock++;
           wait_for_io_done (&frame);
-          frame->lock--;
+          unlock_frame (frame);
           success = true;
         }
     }
@@ -372,8 +577,20 @@ load_frame (uint32_t *pd, const void *upage, bool write, bool keep_locked)
               frame->lock++;
               if (page_info->swapped)
                 {
+                  /* Read the page's neighbours in swap along with it.
+                     PAGES[] has a null pointer in place of PAGE_INFO. */
+                  cnt = swap_read_around (page_info, pages);
+                  for (i = 0; i < cnt; i++)
+                    if (pages[i] != NULL)
+                      kpages[i] = pages[i]->frame->kpage;
+                    else
+                      {
+                        kpages[i] = frame->kpage;
+                        first = (page_info->data.swap_sector
+                                 - i * SECTORS_PER_PAGE);
+                      }
                   lock_release (&frame_lock);
-                  swap_read (page_info->data.swap_sector, frame->kpage);
+                  swap_read_cluster (first, kpages, cnt);
                   page_info->swapped = false;
                 }
               else
@@ -386,16 +603,23 @@ load_frame (uint32_t *pd, const void *upage, bool write, bool keep_locked)
                          reading the same data into a new frame. */
                       hash_insert (&read_only_frames, &frame->hash_elem);
                     }
-                  file_info = &page_info->data.file_info;
+                  /* Read the pages that follow in the file after it. */
+                  cnt = file_read_ahead (page_info, pages);
                   lock_release (&frame_lock);
-                  bytes_read = file_read_at (file_info->file,
-                                             frame->kpage,
-                                             size (file_info->end_offset),
-                                             offset (file_info->end_offset));
-                  ASSERT (bytes_read == size (file_info->end_offset));
+                  for (i = 0; i < cnt; i++)
+                    {
+                      p = pages[i] != NULL ? pages[i] : page_info;
+                      file_info = &p->data.file_info;
+                      bytes_read = file_read_at (file_info->file,
+                                                 p->frame->kpage,
+                                                 size (file_info->end_offset),
+                                                 offset (file_info->end_offset));
+                      ASSERT (bytes_read == size (file_info->end_offset));
+                    }
                 }
               lock_acquire (&frame_lock);
-              frame->lock--;
+              finish_prefetch (pages, cnt);
+              unlock_frame (frame);
               frame->io = false;
               cond_broadcast (&frame->io_done, &frame_lock);
             }
@@ -426,10 +650,34 @@ frame_init (struct frame *frame)
   cond_init (&frame->io_done);
 }
 
+/* Returns a frame to load a page into, evicting one if there are
+   no free frames. */
 static struct frame *
 allocate_frame (void)
 {
   struct frame *frame;
+
+  for (;;)
+    {
+      frame = new_frame ();
+      if (palloc_free_cnt (PAL_USER) < low_water)
+        cond_signal (&pageout_wanted, &frame_lock);
+      if (frame != NULL || list_empty (&frame_list))
+        return frame;
+      frame = evict_frame ();
+      if (frame != NULL)
+        return frame;
+      /* Every frame is locked. */
+      cond_wait (&frame_available, &frame_lock);
+    }
+}
+
+/* Returns a new frame from the free frames, or a null pointer if 
+   there are none left. */
+static struct frame *
+new_frame (void)
+{
+  struct frame *frame = NULL;
   void *kpage;
   
   kpage = palloc_get_page (PAL_USER | PAL_ZERO);
@@ -453,8 +701,6 @@ allocate_frame (void)
       else
         palloc_free_page (kpage);
     }
-  else
-    frame = evict_frame ();
   return frame;
 }
 
@@ -464,11 +710,60 @@ map_page (struct page_info *page_info, struct frame *frame, const void *upage)
   page_info->frame = frame;
   list_push_back (&frame->page_info_list, &page_info->elem);
   pagedir_set_page (page_info->pd, upage, frame->kpage,
-                    page_info->writable != 0);
+                    page_info->writable != 0 && !page_info->cow);
   pagedir_set_dirty (page_info->pd, upage, false);
   pagedir_set_accessed (page_info->pd, upage, true);
 }
 
+/* Makes PAGE_INFO's page, loaded and shared copy-on-write, writable.
+   If other pages still share its frame, it's given a copy of the 
+   frame first.  Returns false if no frame can be allocated. */
+static bool
+break_cow (struct page_info *page_info)
+{
+  struct frame *shared = page_info->frame;
+  struct frame *frame;
+
+  ASSERT (page_info->cow);
+  if (list_size (&shared->page_info_list) == 1)
+    {
+      /* The other pages have gone. */
+      page_info->cow = false;
+      pagedir_set_writable (page_info->pd, page_info->upage, true);
+      return true;
+    }
+  /* Keep the shared frame from being evicted while a frame is found 
+     to copy it to. */
+  shared->lock++;
+  frame = allocate_frame ();
+  unlock_frame (shared);
+  if (frame == NULL)
+    return false;
+  memcpy (frame->kpage, shared->kpage, PGSIZE);
+  list_remove (&page_info->elem);
+  pagedir_clear_page (page_info->pd, page_info->upage);
+  page_info->cow = false;
+  map_page (page_info, frame, page_info->upage);
+  /* The other pages may have been unloaded while waiting for a frame. */
+  if (list_empty (&shared->page_info_list))
+    release_frame (shared);
+  cow_copies++;
+  return true;
+}
+
+/* Returns the file in CHILD_FILES[] at the index of FILE in FILES[],
+   both MAX_OPEN_FILES long, or a null pointer if FILE isn't there. */
+static struct file *
+child_file (struct file *file, struct file **files, struct file **child_files)
+{
+  int fd;
+
+  for (fd = 0; fd < MAX_OPEN_FILES; fd++)
+    if (files[fd] == file)
+      return child_files[fd];
+  return NULL;
+}
+
 static void
 wait_for_io_done (struct frame **frame)
 {
@@ -476,19 +771,188 @@ wait_for_io_done (struct frame **frame)
     cond_wait (&(*frame)->io_done, &frame_lock);
 }
 
-/* Evicts and returns a free frame. */
+/* Finds the pages next to PAGE_INFO, which is about to be read from 
+   swap, in its address space that were written to the swap slots 
+   next to its own, and gives as many of them as there are spare
+   free frames (see prefetch_page()) frames to be read into.  Stores them in PAGES[] in the
+   order of their swap slots, with a null pointer in place of 
+   PAGE_INFO, and returns the number of entries, so that all of them
+   can be read with one transfer.  Never evicts a frame. */
+static size_t
+swap_read_around (struct page_info *page_info, struct page_info *pages[])
+{
+  struct page_info *before[READ_AROUND_MAX];
+  struct page_info *p;
+  block_sector_t sector = page_info->data.swap_sector;
+  size_t before_cnt = 0;
+  size_t cnt = 0;
+  int i;
+
+  /* Pages written out in the order they were mapped. */
+  for (i = 1; i <= READ_AROUND_MAX; i++)
+    {
+      p = get_neighbour (page_info, i);
+      if (p == NULL || !p->swapped
+          || p->data.swap_sector != sector + i * SECTORS_PER_PAGE
+          || !prefetch_page (p))
+        break;
+      pages[++cnt] = p;
+    }
+  /* Pages written out in the opposite order, like a stack's. */
+  for (i = -1; cnt + before_cnt < READ_AROUND_MAX; i--)
+    {
+      p = get_neighbour (page_info, i);
+      if (p == NULL || !p->swapped
+          || p->data.swap_sector != sector + i * SECTORS_PER_PAGE
+          || !prefetch_page (p))
+        break;
+      before[before_cnt++] = p;
+    }
+  if (before_cnt > 0)
+    memmove (pages + before_cnt, pages, (cnt + 1) * sizeof *pages);
+  for (i = 0; i < (int) before_cnt; i++)
+    pages[i] = before[before_cnt - 1 - i];
+  pages[before_cnt] = NULL;
+  return before_cnt + 1 + cnt;
+}
+
+/* Finds the pages that follow PAGE_INFO, which is about to be read
+   from its file, in the same file mapping, and gives as many of them 
+   as there are spare free frames frames to be read into.  Stores a 
+   null pointer for PAGE_INFO and then those pages in PAGES[] and 
+   returns the number of entries.  Never evicts a frame. */
+static size_t
+file_read_ahead (struct page_info *page_info, struct page_info *pages[])
+{
+  struct file_info *file_info = &page_info->data.file_info;
+  struct page_info *p;
+  size_t cnt = 1;
+  int i;
+
+  pages[0] = NULL;
+  for (i = 1; i <= READ_AROUND_MAX; i++)
+    {
+      p = get_neighbour (page_info, i);
+      if (p == NULL || p->swapped || !(p->type & PAGE_TYPE_FILE)
+          || p->data.file_info.file != file_info->file
+          || (offset (p->data.file_info.end_offset)
+              != offset (file_info->end_offset) + i * PGSIZE)
+          || (p->writable == 0 && lookup_read_only_frame (p) != NULL)
+          || !prefetch_page (p))
+        break;
+      /* Like the faulting page, make the frame visible to other
+         processes before reading it, so they wait for the read. */
+      if (p->writable == 0)
+        hash_insert (&read_only_frames, &p->frame->hash_elem);
+      pages[cnt++] = p;
+    }
+  return cnt;
+}
+
+/* Returns the page info of the page I pages after (or before, if I is
+   negative) PAGE_INFO's page in the same address space, if it's a
+   page that isn't loaded, or a null pointer. */
+static struct page_info *
+get_neighbour (struct page_info *page_info, int i)
+{
+  uintptr_t upage = (uintptr_t) page_info->upage + i * PGSIZE;
+  struct page_info *p;
+
+  if (upage == 0 || !is_user_vaddr ((void *) upage))
+    return NULL;
+  p = pagedir_get_info (page_info->pd, (void *) upage);
+  return p != NULL && p->frame == NULL ? p : NULL;
+}
+
+/* Loads PAGE_INFO's page into a free frame along with a faulting 
+   page, marking the frame as being read, or returns false if free
+   frames are down to the low watermark.  Those are kept for demand
+   faults, and the pageout thread is woken to replenish them. */
+static bool
+prefetch_page (struct page_info *page_info)
+{
+  struct frame *frame;
+
+  if (palloc_free_cnt (PAL_USER) <= low_water)
+    {
+      cond_signal (&pageout_wanted, &frame_lock);
+      return false;
+    }
+  frame = new_frame ();
+  if (frame == NULL)
+    return false;
+  map_page (page_info, frame, page_info->upage);
+  /* Let the clock evict it first unless it's used. */
+  pagedir_set_accessed (page_info->pd, page_info->upage, false);
+  page_info->prefetched = true;
+  frame->io = true;
+  frame->lock++;
+  prefetches++;
+  return true;
+}
+
+/* Marks the frames of the CNT pages in PAGES[], other than null
+   pointers, as read. */
+static void
+finish_prefetch (struct page_info *pages[], size_t cnt)
+{
+  struct frame *frame;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (pages[i] != NULL)
+      {
+        frame = pages[i]->frame;
+        pages[i]->swapped = false;
+        unlock_frame (frame);
+        frame->io = false;
+        cond_broadcast (&frame->io_done, &frame_lock);
+      }
+}
+
+/* Returns true if PAGE_INFO's page has been accessed since this was
+   last called for it, and clears its accessed bit.  The first
+   access to a prefetched page is a major fault avoided. */
+static bool
+test_accessed (struct page_info *page_info)
+{
+  bool accessed = pagedir_is_accessed (page_info->pd, page_info->upage);
+
+  if (page_info->prefetched)
+    {
+      if (accessed)
+        faults_avoided++;
+      page_info->prefetched = false;
+    }
+  pagedir_set_accessed (page_info->pd, page_info->upage, false);
+  return accessed;
+}
+
+/* Evicts and returns a free frame.  If the frame has to be written
+   to swap, other frames that are ready to be evicted to swap are
+   written along with it into consecutive swap slots, and freed, so
+   that the next few frames are allocated without evicting.  Returns
+   a null pointer if every frame is locked. */
 static void *
 evict_frame (void)
 {
   struct frame *frame;
+  struct frame *cluster[SWAP_CLUSTER_MAX];
+  void *kpages[SWAP_CLUSTER_MAX];
+  block_sector_t swap_sectors[SWAP_CLUSTER_MAX];
   struct page_info *page_info;
   struct file_info *file_info;
   off_t bytes_written;
   block_sector_t swap_sector;
   struct list_elem *e;
+  size_t cluster_cnt = 0;
+  size_t swapped_cnt = 0;
+  size_t i;
   bool dirty = false;
 
-  frame = get_frame_to_evict();
+  frame = get_frame_to_evict ();
+  if (frame == NULL)
+    return NULL;
   for (e = list_begin (&frame->page_info_list);
        e != list_end (&frame->page_info_list); e = list_next (e))
     {
@@ -521,14 +985,29 @@ evict_frame (void)
                                          size (file_info->end_offset),
                                          offset (file_info->end_offset));
           ASSERT (bytes_written == size (file_info->end_offset));          
+          lock_acquire (&frame_lock);
         }
       else
         {
+          cluster[0] = frame;
+          cluster_cnt = 1 + get_swap_cluster (cluster + 1,
+                                              SWAP_CLUSTER_MAX - 1);
+          for (i = 0; i < cluster_cnt; i++)
+            kpages[i] = cluster[i]->kpage;
           lock_release (&frame_lock);
-          swap_sector = swap_write (frame->kpage);
+          swap_write_cluster (kpages, cluster_cnt, swap_sectors);
+          swap_sector = swap_sectors[0];
+          lock_acquire (&frame_lock);
+          for (i = 1; i < cluster_cnt; i++)
+            {
+              page_info = list_entry (list_front (&cluster[i]->page_info_list),
+                                      struct page_info, elem);
+              page_info->swapped = true;
+              page_info->data.swap_sector = swap_sectors[i];
+              free_evicted_frame (cluster[i]);
+            }
         }
-      lock_acquire (&frame_lock);
-      frame->lock--;
+      unlock_frame (frame);
       frame->io = false;
       cond_broadcast (&frame->io_done, &frame_lock);
     }
@@ -545,20 +1024,151 @@ evict_frame (void)
       page_info->frame = NULL;
       if (page_info->writable & WRITABLE_TO_SWAP)
         {
+          /* Pages that shared the frame copy-on-write share the swap
+             slot it was written to. */
+          if (swapped_cnt++ > 0)
+            swap_share (swap_sector);
           page_info->swapped = true;
           page_info->data.swap_sector = swap_sector;
         }
+      page_info->cow = false;
       e = list_remove (e);
     }
   memset (frame->kpage, 0, PGSIZE);
   return frame;
 }
 
+/* Continues the clock past the frame chosen for eviction, looking
+   at up to CLUSTER_SCAN frames for unlocked, unaccessed frames that
+   would be written to swap if evicted.  Unmaps and locks up to MAX 
+   of them, marked as being written, stores them in FRAMES[], and
+   returns the number found. */
+static size_t
+get_swap_cluster (struct frame *frames[], size_t max)
+{
+  struct frame *frame;
+  struct page_info *page_info;
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < CLUSTER_SCAN && cnt < max; i++)
+    {
+      frame = list_entry (clock_hand, struct frame, list_elem);
+      clock_hand = list_next (clock_hand);
+      if (clock_hand == list_end (&frame_list))
+        clock_hand = list_begin (&frame_list);
+      if (frame->lock > 0 || !is_swap_frame (frame))
+        continue;
+      page_info = list_entry (list_front (&frame->page_info_list),
+                              struct page_info, elem);
+      if (test_accessed (page_info))
+        continue;
+      pagedir_clear_page (page_info->pd, page_info->upage);
+      frame->io = true;
+      frame->lock++;
+      frames[cnt++] = frame;
+    }
+  return cnt;
+}
+
+/* Returns true if FRAME holds a single page that's written to
+   swap when it's evicted. */
+static bool
+is_swap_frame (struct frame *frame)
+{
+  struct page_info *page_info;
+
+  if (list_size (&frame->page_info_list) != 1)
+    return false;
+  page_info = list_entry (list_front (&frame->page_info_list),
+                          struct page_info, elem);
+  return (page_info->writable & WRITABLE_TO_SWAP
+          && !(page_info->writable & WRITABLE_TO_FILE));
+}
+
+/* Finishes evicting FRAME, found by get_swap_cluster(), whose page
+   has been written to swap, and frees it. */
+static void
+free_evicted_frame (struct frame *frame)
+{
+  struct page_info *page_info;
+
+  page_info = list_entry (list_front (&frame->page_info_list),
+                          struct page_info, elem);
+  page_info->frame = NULL;
+  page_info->cow = false;
+  list_remove (&page_info->elem);
+  unlock_frame (frame);
+  frame->io = false;
+  cond_broadcast (&frame->io_done, &frame_lock);
+  release_frame (frame);
+}
+
+/* Removes FRAME, which maps no pages, from the frame list and frees
+   it. */
+static void
+release_frame (struct frame *frame)
+{
+  ASSERT (list_empty (&frame->page_info_list));
+  ASSERT (frame->lock == 0);
+  if (clock_hand == &frame->list_elem)
+    {
+      clock_hand = list_next (clock_hand);
+      if (clock_hand == list_end (&frame_list))
+        clock_hand = list_begin (&frame_list);
+    }
+  list_remove (&frame->list_elem);
+  if (list_empty (&frame_list))
+    clock_hand = list_end (&frame_list);
+  palloc_free_page (frame->kpage);
+  free (frame);
+  cond_broadcast (&frame_available, &frame_lock);
+}
+
+/* Unlocks FRAME, locked once more by the caller, and wakes up 
+   threads waiting for a frame if it can now be evicted. */
+static void
+unlock_frame (struct frame *frame)
+{
+  ASSERT (frame->lock > 0);
+  if (--frame->lock == 0)
+    cond_broadcast (&frame_available, &frame_lock);
+}
+
+/* The pageout thread.  Sleeps until free frames drop below
+   LOW_WATER, then evicts frames, writing them out as needed, until
+   HIGH_WATER are free. */
+static void
+pageout (void *aux UNUSED)
+{
+  struct frame *frame;
+
+  lock_acquire (&frame_lock);
+  for (;;)
+    {
+      while (palloc_free_cnt (PAL_USER) >= low_water)
+        cond_wait (&pageout_wanted, &frame_lock);
+      while (palloc_free_cnt (PAL_USER) < high_water)
+        {
+          frame = list_empty (&frame_list) ? NULL : evict_frame ();
+          if (frame == NULL)
+            {
+              /* Nothing can be evicted right now. */
+              cond_wait (&frame_available, &frame_lock);
+              continue;
+            }
+          release_frame (frame);
+          pageouts++;
+        }
+    }
+}
+
 /* Implementation of the clock page replacement algorithm. A list of frames
    is maintained for eviction.  The "clock hand" points to the next frame to 
    examine.  A frame is eligible for eviction if the access bit is set and it's
    not locked.  If the page is not eligible the access bit is cleared and the
-   next frame is examined.  In both cases, the clock hand is moved forward. */ 
+   next frame is examined.  In both cases, the clock hand is moved forward.
+   Returns a null pointer if every frame is locked. */ 
 static void *
 get_frame_to_evict (void)
 {
@@ -569,7 +1179,8 @@ get_frame_to_evict (void)
   struct list_elem *e;
   bool accessed;
 
-  ASSERT (!list_empty (&frame_list));
+  if (list_empty (&frame_list))
+    return NULL;
   start = list_entry (clock_hand, struct frame, list_elem);
   frame = start;
   do
@@ -582,9 +1193,8 @@ get_frame_to_evict (void)
                e != list_end (&frame->page_info_list); e = list_next (e))
             {
               page_info = list_entry (e, struct page_info, elem);
-              accessed = accessed || pagedir_is_accessed (page_info->pd,
-                                                          page_info->upage);
-              pagedir_set_accessed (page_info->pd, page_info->upage, false);
+              if (test_accessed (page_info))
+                accessed = true;
             }
           if (!accessed)
             found = frame;
@@ -596,14 +1206,20 @@ get_frame_to_evict (void)
     } while (!found && frame != start);
   if (found == NULL)
     {
-      /* Iterated through the entire list and ended up back at the start. */
+      /* Iterated through the entire list and ended up back at the start,
+         clearing every accessed bit on the way.  Take the first frame
+         that isn't locked; frames being written to swap in a cluster
+         may have left START locked. */
       ASSERT (frame == start);
-      if (frame->lock > 0)
-        PANIC ("no frame available for eviction");
-      found = frame;
-      clock_hand = list_next (clock_hand);
-      if (clock_hand == list_end (&frame_list))
-        clock_hand = list_begin (&frame_list);
+      do
+        {
+          if (frame->lock == 0)
+            found = frame;
+          clock_hand = list_next (clock_hand);
+          if (clock_hand == list_end (&frame_list))
+            clock_hand = list_begin (&frame_list);
+          frame = list_entry (clock_hand, struct frame, list_elem);
+        } while (!found && frame != start);
     }
 
   return found;
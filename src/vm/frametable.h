@@ -2,10 +2,20 @@
 #define VM_FRAMETABLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct file;
 
 void frametable_init(void);
+void frametable_set_watermarks (size_t low, size_t high);
+void frametable_start_pageout (void);
+void frametable_print_stats (void);
 bool frametable_load_frame(uint32_t *pd, const void *upage, bool write);
 void frametable_unload_frame (uint32_t *pd, const void *upage);
+bool frametable_share_page (uint32_t *pd, const void *upage,
+                            uint32_t *child_pd, struct file **files,
+                            struct file **child_files);
 bool frametable_lock_frame(uint32_t *pd, const void *upage, bool write);
 void frametable_unlock_frame(uint32_t *pd, const void *upage);
 
@@ -1,77 +1,213 @@
 #include <stdbool.h>
 #include <debug.h>
 #include <bitmap.h>
+#include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/vaddr.h"
 #include "vm/swap.h"
+#include "vm/zswap.h"
 
-#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
-
-static bool swap_map_allocate (block_sector_t *sectorp);
+static size_t swap_map_allocate (size_t cnt, block_sector_t *sectorp);
 static void swap_map_release (block_sector_t sector);
+static bool swap_unshare (block_sector_t sector);
+static void swap_transfer (block_sector_t sector, void *kpages[], size_t cnt,
+                           bool is_write);
   
 struct block *swap_device;
+/* Protects swap_map, swap_refs, and swap_next. */
+static struct lock swap_lock;
 /* Free map, one bit per page size sector chunk. */
 static struct bitmap *swap_map;  
+/* Number of pages sharing each chunk besides the first, because the
+   chunk was written from a frame shared copy-on-write. */
+static unsigned short *swap_refs;
+/* Where the next search of swap_map starts, just past the last chunk
+   allocated, so that pages written out together land next to each
+   other. */
+static size_t swap_next;
 
 void
 swap_init(void)
 {
   ASSERT (PGSIZE % BLOCK_SECTOR_SIZE == 0);
+  lock_init (&swap_lock);
   swap_device = block_get_role (BLOCK_SWAP);
   swap_map = bitmap_create (block_size (swap_device) / SECTORS_PER_PAGE);
   if (swap_map == NULL)
     PANIC ("bitmap creation failed--swap device is too large");
+  swap_refs = calloc (bitmap_size (swap_map), sizeof *swap_refs);
+  if (swap_refs == NULL)
+    PANIC ("swap reference counts allocation failed");
+  zswap_init ();
 }
 
 /* Writes a page to swap. */
 block_sector_t
 swap_write (void *kpage)
 {
-  int i;
   block_sector_t sector;
-  
-  if (!swap_map_allocate (&sector))
-    PANIC ("no swap space");
 
-  for (i = 0; i < SECTORS_PER_PAGE; i++, sector++, kpage += BLOCK_SECTOR_SIZE)
-    block_write (swap_device, sector, kpage);
-  return sector - SECTORS_PER_PAGE;
+  swap_write_cluster (&kpage, 1, &sector);
+  return sector;
+}
+
+/* Writes the CNT pages KPAGES[] to swap and stores the first sector
+   of each in SECTORS[].  The pages are given consecutive chunks of
+   swap where possible.  Pages that compress well are kept in the
+   compressed swap cache, and each run of the others goes to the 
+   device as a single sequential transfer. */
+void
+swap_write_cluster (void *kpages[], size_t cnt, block_sector_t sectors[])
+{
+  block_sector_t sector;
+  size_t i, n, first;
+
+  ASSERT (cnt <= SWAP_CLUSTER_MAX);
+  for (; cnt > 0; kpages += n, sectors += n, cnt -= n)
+    {
+      n = swap_map_allocate (cnt, &sector);
+      if (n == 0)
+        PANIC ("no swap space");
+      for (first = i = 0; i <= n; i++)
+        {
+          if (i < n)
+            {
+              sectors[i] = sector + i * SECTORS_PER_PAGE;
+              if (!zswap_store (sectors[i], kpages[i]))
+                continue;
+            }
+          swap_transfer (sector + first * SECTORS_PER_PAGE, kpages + first,
+                         i - first, true);
+          first = i + 1;
+        }
+    }
 }
 
 /* Reads a page from swap. */
 void
 swap_read (block_sector_t sector, void *kpage)
 {
-  int i;
-  
-  for (i = 0; i < SECTORS_PER_PAGE; i++, sector++, kpage += BLOCK_SECTOR_SIZE)
-    block_read (swap_device, sector, kpage);
-  swap_release (sector - SECTORS_PER_PAGE);
+  swap_read_cluster (sector, &kpage, 1);
+}
+
+/* Reads CNT pages from the consecutive chunks of swap starting at
+   SECTOR into KPAGES[] and releases the chunks, which stay in use
+   as long as other pages share them.  Pages in the compressed swap
+   cache are decompressed, and each run of the others is read with a
+   single transfer. */
+void
+swap_read_cluster (block_sector_t sector, void *kpages[], size_t cnt)
+{
+  size_t i, first;
+
+  ASSERT (cnt <= SWAP_CLUSTER_MAX);
+  for (first = i = 0; i <= cnt; i++)
+    {
+      if (i < cnt && !zswap_load (sector + i * SECTORS_PER_PAGE, kpages[i]))
+        continue;
+      swap_transfer (sector + first * SECTORS_PER_PAGE, kpages + first,
+                     i - first, false);
+      first = i + 1;
+    }
+  for (i = 0; i < cnt; i++)
+    swap_release (sector + i * SECTORS_PER_PAGE);
 }
 
-/* Releases a swap sector so it can be reused. */
+/* Writes the CNT pages KPAGES[] to the consecutive chunks of swap 
+   starting at SECTOR if IS_WRITE is true, or reads them from there 
+   otherwise, with a single transfer. */
+static void
+swap_transfer (block_sector_t sector, void *kpages[], size_t cnt,
+               bool is_write)
+{
+  void *buffers[SWAP_CLUSTER_MAX * SECTORS_PER_PAGE];
+  size_t i, j;
+
+  if (cnt == 0)
+    return;
+  for (i = 0; i < cnt; i++)
+    for (j = 0; j < SECTORS_PER_PAGE; j++)
+      buffers[i * SECTORS_PER_PAGE + j] 
+        = (uint8_t *) kpages[i] + j * BLOCK_SECTOR_SIZE;
+  if (is_write)
+    block_writev (swap_device, sector, buffers, cnt * SECTORS_PER_PAGE);
+  else
+    block_readv (swap_device, sector, buffers, cnt * SECTORS_PER_PAGE);
+}
+
+/* Lets one more page share the swap sector SECTOR.  The sector has
+   to be released once for each page sharing it. */
+void
+swap_share (block_sector_t sector)
+{
+  lock_acquire (&swap_lock);
+  ASSERT (bitmap_test (swap_map, sector / SECTORS_PER_PAGE));
+  swap_refs[sector / SECTORS_PER_PAGE]++;
+  lock_release (&swap_lock);
+}
+
+/* Releases a swap sector so it can be reused, once no other page
+   shares it. */
 void
 swap_release (block_sector_t sector)
 {
+  if (swap_unshare (sector))
+    return;
+  zswap_drop (sector);
   swap_map_release (sector);
 }
 
-/* Allocates a page size chunk of consecutive sectors and stores the first
-   into *SECTORP.  Returns true if successful, false if not enough sectors 
-   are left. */
+/* Allocates up to CNT consecutive page size chunks of sectors, as
+   many as can be found together, stores the first sector into 
+   *SECTORP, and returns the number of chunks allocated, which is 0
+   if swap is full. */
+static size_t
+swap_map_allocate (size_t cnt, block_sector_t *sectorp)
+{
+  size_t chunk = BITMAP_ERROR;
+
+  lock_acquire (&swap_lock);
+  for (; cnt > 0; cnt /= 2)
+    {
+      chunk = bitmap_scan_and_flip (swap_map, swap_next, cnt, false);
+      if (chunk == BITMAP_ERROR)
+        chunk = bitmap_scan_and_flip (swap_map, 0, cnt, false);
+      if (chunk != BITMAP_ERROR)
+        break;
+    }
+  if (chunk != BITMAP_ERROR)
+    {
+      swap_next = (chunk + cnt) % bitmap_size (swap_map);
+      *sectorp = chunk * SECTORS_PER_PAGE;
+    }
+  else
+    cnt = 0;
+  lock_release (&swap_lock);
+  return cnt;
+}
+
+/* Drops one of the pages sharing the chunk of sectors starting at
+   SECTOR.  Returns false if no other page shares it. */
 static bool
-swap_map_allocate (block_sector_t *sectorp)
+swap_unshare (block_sector_t sector)
 {
-  block_sector_t sector = bitmap_scan_and_flip (swap_map, 0, 1, false);
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector * SECTORS_PER_PAGE;
-  return sector != BITMAP_ERROR;  
+  unsigned short *refs = &swap_refs[sector / SECTORS_PER_PAGE];
+  bool shared;
+
+  lock_acquire (&swap_lock);
+  shared = *refs > 0;
+  if (shared)
+    (*refs)--;
+  lock_release (&swap_lock);
+  return shared;
 }
 
 /* Makes a page size chunk of sectors starting at SECTOR available for use. */
 static void
 swap_map_release (block_sector_t sector)
 {
+  lock_acquire (&swap_lock);
   ASSERT (bitmap_all (swap_map, sector / SECTORS_PER_PAGE, 1));
   bitmap_set_multiple (swap_map, sector / SECTORS_PER_PAGE, 1, false);  
+  lock_release (&swap_lock);
 }
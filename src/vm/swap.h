@@ -1,11 +1,23 @@
 #ifndef VM_SWAP_H
 #define VM_SWAP_H
 
+#include <stddef.h>
 #include "devices/block.h"
+#include "threads/vaddr.h"
+
+/* Number of swap sectors holding a page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Maximum number of pages swap_write_cluster() writes, or
+   swap_read_cluster() reads, at once. */
+#define SWAP_CLUSTER_MAX 8
 
 void swap_init(void);
 block_sector_t swap_write (void *kpage);
+void swap_write_cluster (void *kpages[], size_t cnt, block_sector_t sectors[]);
 void swap_read (block_sector_t sector, void *kpage);
+void swap_read_cluster (block_sector_t sector, void *kpages[], size_t cnt);
+void swap_share (block_sector_t sector);
 void swap_release (block_sector_t sector);
 
 #endif /* vm/swap.h */
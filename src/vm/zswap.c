@@ -0,0 +1,332 @@
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Compressed swap cache.  Pages written to swap that compress well
+   are kept compressed in kernel memory, under the swap slot they
+   were given, instead of being written to the swap device.  Only
+   pages that don't compress, or don't fit in the pool, are written.
+
+   Pages are compressed by run-length encoding their 32-bit words,
+   which catches the zeroed and partly zeroed pages that make up
+   much of what programs swap.  A compressed page is a sequence of
+   runs, each a header word followed by its words.  A header of
+   (N << 1) | 1 is followed by one word repeated N times, a header
+   of N << 1 by N words copied as they are.
+
+   The compressed pages are kept in pages of the cache's own, taken
+   from the kernel pool as they're needed, up to the configured
+   number.  Each is divided into chunks of CHUNK_SIZE bytes, and a
+   compressed page takes a run of chunks within one page. */
+
+#define PAGE_WORDS (PGSIZE / sizeof (uint32_t))
+
+/* Largest compressed page kept, in words.  Anything bigger isn't
+   worth the memory. */
+#define MAX_WORDS (PAGE_WORDS / 4)
+
+/* Pool pages are allocated in chunks of this many bytes.  The first
+   chunk of each holds its header. */
+#define CHUNK_SIZE 64
+#define PAGE_CHUNKS (PGSIZE / CHUNK_SIZE)
+
+/* Header of a pool page. */
+struct pool_page
+  {
+    struct list_elem elem;              /* Element in pool. */
+    struct bitmap *used;                /* Chunks in use. */
+    uint8_t used_buf[];                 /* Holds USED. */
+  };
+
+/* A compressed page. */
+struct zpage
+  {
+    struct hash_elem elem;              /* Element in zpages. */
+    block_sector_t sector;              /* Swap slot's first sector. */
+    size_t cnt;                         /* Number of words in DATA. */
+    uint32_t data[];                    /* Compressed page. */
+  };
+
+/* Protects everything below. */
+static struct lock zswap_lock;
+/* Compressed pages, indexed by swap slot. */
+static struct hash zpages;
+/* Pages holding them. */
+static struct list pool;
+/* Pages the pool may have, and has now. */
+static size_t pool_limit;
+static size_t pool_used;
+/* Pool size in pages set by zswap_configure(), or -1 for the
+   default of an eighth of the kernel pool. */
+static int pool_pages = -1;
+/* Where pages are compressed. */
+static uint32_t scratch[MAX_WORDS];
+
+/* Statistics. */
+static int stores;              /* Pages kept compressed. */
+static int same_filled;         /* Pages that were one word repeated. */
+static int rejects;             /* Pages that didn't compress. */
+static int spills;              /* Pages written because the pool was full. */
+static int loads;               /* Pages read back from the pool. */
+
+static size_t compress (const uint32_t *page, uint32_t *out);
+static void decompress (const uint32_t *in, size_t cnt, uint32_t *page);
+static void *pool_alloc (size_t size);
+static void pool_free (void *block, size_t size);
+static struct zpage *lookup (block_sector_t sector);
+static unsigned zpage_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool zpage_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
+
+void
+zswap_init (void)
+{
+  lock_init (&zswap_lock);
+  hash_init (&zpages, zpage_hash, zpage_less, NULL);
+  list_init (&pool);
+  if (pool_pages < 0)
+    pool_pages = palloc_page_cnt (0) / 8;
+  pool_limit = pool_pages;
+}
+
+/* Lets the compressed pages use PAGES pages of kernel memory.  0
+   disables the cache.  Must be called before zswap_init(). */
+void
+zswap_configure (int pages)
+{
+  pool_pages = pages;
+}
+
+/* Compresses KPAGE, being written to the swap slot that starts at
+   SECTOR, and keeps it in the pool.  Returns false if it has to be
+   written to the swap device instead. */
+bool
+zswap_store (block_sector_t sector, const void *kpage)
+{
+  struct zpage *zpage = NULL;
+  size_t cnt, size;
+
+  if (pool_limit == 0)
+    return false;
+  lock_acquire (&zswap_lock);
+  cnt = compress (kpage, scratch);
+  size = sizeof *zpage + cnt * sizeof *scratch;
+  if (cnt == 0)
+    rejects++;
+  else if ((zpage = pool_alloc (size)) == NULL)
+    spills++;
+  else
+    {
+      zpage->sector = sector;
+      zpage->cnt = cnt;
+      memcpy (zpage->data, scratch, cnt * sizeof *scratch);
+      hash_insert (&zpages, &zpage->elem);
+      stores++;
+      if (cnt == 2)
+        same_filled++;
+    }
+  lock_release (&zswap_lock);
+  return zpage != NULL;
+}
+
+/* If the page in the swap slot that starts at SECTOR is in the pool,
+   decompresses it into KPAGE and returns true.  Otherwise returns
+   false.  The page stays in the pool until its slot is released,
+   since pages sharing the slot may still read it. */
+bool
+zswap_load (block_sector_t sector, void *kpage)
+{
+  struct zpage *zpage;
+
+  if (pool_limit == 0)
+    return false;
+  lock_acquire (&zswap_lock);
+  zpage = lookup (sector);
+  if (zpage != NULL)
+    {
+      decompress (zpage->data, zpage->cnt, kpage);
+      loads++;
+    }
+  lock_release (&zswap_lock);
+  return zpage != NULL;
+}
+
+/* Discards the page in the swap slot that starts at SECTOR, if it's
+   in the pool. */
+void
+zswap_drop (block_sector_t sector)
+{
+  struct zpage *zpage;
+
+  if (pool_limit == 0)
+    return;
+  lock_acquire (&zswap_lock);
+  zpage = lookup (sector);
+  if (zpage != NULL)
+    {
+      hash_delete (&zpages, &zpage->elem);
+      pool_free (zpage, sizeof *zpage + zpage->cnt * sizeof *zpage->data);
+    }
+  lock_release (&zswap_lock);
+}
+
+/* Prints compressed swap statistics. */
+void
+zswap_print_stats (void)
+{
+  printf ("Compressed swap: %d pages stored (%d same-filled), "
+          "%d incompressible, %d spilled, %d loaded\n",
+          stores, same_filled, rejects, spills, loads);
+}
+
+/* Compresses PAGE into OUT and returns the number of words used, or
+   0 if that would be more than MAX_WORDS. */
+static size_t
+compress (const uint32_t *page, uint32_t *out)
+{
+  size_t i = 0;
+  size_t cnt = 0;
+  size_t n;
+
+  while (i < PAGE_WORDS)
+    {
+      for (n = 1; i + n < PAGE_WORDS && page[i + n] == page[i]; n++)
+        continue;
+      if (n >= 2)
+        {
+          if (cnt + 2 > MAX_WORDS)
+            return 0;
+          out[cnt++] = n << 1 | 1;
+          out[cnt++] = page[i];
+        }
+      else
+        {
+          /* Copy words up to the next repeated word. */
+          while (i + n < PAGE_WORDS
+                 && !(i + n + 1 < PAGE_WORDS && page[i + n] == page[i + n + 1]))
+            n++;
+          if (cnt + 1 + n > MAX_WORDS)
+            return 0;
+          out[cnt++] = n << 1;
+          memcpy (out + cnt, page + i, n * sizeof *page);
+          cnt += n;
+        }
+      i += n;
+    }
+  return cnt;
+}
+
+/* Decompresses the CNT words IN into PAGE. */
+static void
+decompress (const uint32_t *in, size_t cnt, uint32_t *page)
+{
+  const uint32_t *end = in + cnt;
+  size_t n, i;
+
+  while (in < end)
+    {
+      n = *in >> 1;
+      if (*in++ & 1)
+        {
+          for (i = 0; i < n; i++)
+            page[i] = *in;
+          in++;
+        }
+      else
+        {
+          memcpy (page, in, n * sizeof *page);
+          in += n;
+        }
+      page += n;
+    }
+}
+
+/* Allocates SIZE bytes in the pool, adding a page to it if none
+   has room and it's below its limit.  Returns a null pointer if
+   that's not possible.  zswap_lock must be held. */
+static void *
+pool_alloc (size_t size)
+{
+  size_t cnt = DIV_ROUND_UP (size, CHUNK_SIZE);
+  struct pool_page *p;
+  struct list_elem *e;
+  size_t idx;
+
+  for (e = list_begin (&pool); e != list_end (&pool); e = list_next (e))
+    {
+      p = list_entry (e, struct pool_page, elem);
+      idx = bitmap_scan_and_flip (p->used, 1, cnt, false);
+      if (idx != BITMAP_ERROR)
+        return (uint8_t *) p + idx * CHUNK_SIZE;
+    }
+
+  if (pool_used >= pool_limit)
+    return NULL;
+  p = palloc_get_page (0);
+  if (p == NULL)
+    return NULL;
+  p->used = bitmap_create_in_buf (PAGE_CHUNKS, p->used_buf,
+                                  CHUNK_SIZE - sizeof *p);
+  bitmap_set_multiple (p->used, 0, 1 + cnt, true);
+  list_push_front (&pool, &p->elem);
+  pool_used++;
+  return (uint8_t *) p + CHUNK_SIZE;
+}
+
+/* Frees BLOCK, SIZE bytes allocated by pool_alloc(), and gives its
+   page back to the kernel pool if that leaves it empty.  zswap_lock
+   must be held. */
+static void
+pool_free (void *block, size_t size)
+{
+  struct pool_page *p = pg_round_down (block);
+  size_t idx = ((uint8_t *) block - (uint8_t *) p) / CHUNK_SIZE;
+
+  bitmap_set_multiple (p->used, idx, DIV_ROUND_UP (size, CHUNK_SIZE), false);
+  if (bitmap_count (p->used, 0, PAGE_CHUNKS, true) == 1)
+    {
+      list_remove (&p->elem);
+      palloc_free_page (p);
+      pool_used--;
+    }
+}
+
+/* Returns the compressed page for the swap slot that starts at
+   SECTOR, or a null pointer if it isn't in the pool. */
+static struct zpage *
+lookup (block_sector_t sector)
+{
+  struct zpage zpage;
+  struct hash_elem *e;
+
+  zpage.sector = sector;
+  e = hash_find (&zpages, &zpage.elem);
+  return e != NULL ? hash_entry (e, struct zpage, elem) : NULL;
+}
+
+static unsigned
+zpage_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct zpage *zpage = hash_entry (e, struct zpage, elem);
+
+  return hash_int (zpage->sector);
+}
+
+static bool
+zpage_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  struct zpage *a = hash_entry (a_, struct zpage, elem);
+  struct zpage *b = hash_entry (b_, struct zpage, elem);
+
+  return a->sector < b->sector;
+}
@@ -0,0 +1,14 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+void zswap_init (void);
+void zswap_configure (int pages);
+bool zswap_store (block_sector_t sector, const void *kpage);
+bool zswap_load (block_sector_t sector, void *kpage);
+void zswap_drop (block_sector_t sector);
+void zswap_print_stats (void);
+
+#endif /* vm/zswap.h */